@@ -0,0 +1,69 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+/*
+ * Benchmark of the typed message channel (CarlaMessageChannel.h) against the json path of
+ * sendToAndGetFromCarla<S,T>, for the light control exchange: encoding of a light_command
+ * GENERIC_MESSAGE and decoding of a light_update GENERIC_RESPONSE, without the socket.
+ *
+ * It is not part of the simulation library. Build it from the repository root, e.g.
+ *   g++ -std=c++14 -O2 -Isrc/carlanet bench/GenericMessageBench.cc -o genericMessageBench
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "lightcontrol/CarlaMessages.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+static const int NUM_EXCHANGES = 200000;
+
+int main()
+{
+    light_command command;
+    command.light_next_state = "1";
+    light_update update;
+    update.light_curr_state = "2";
+    json jsonResponse = {{"message_type", "GENERIC_RESPONSE"}, {"user_defined", update}, {"simulation_status", 0}};
+    string response = jsonResponse.dump();
+    size_t checksum = 0;  // keeps the work from being optimised away
+
+    // As the json path of CarlanetManager: request and response go through json trees
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < NUM_EXCHANGES; i++) {
+        json userDefined = command;
+        json envelope = {{"message_type", "GENERIC_MESSAGE"}, {"timestamp", 1.0 * i}, {"user_defined", userDefined}};
+        checksum += envelope.dump().size();
+        json received = json::parse(response);
+        checksum += received["simulation_status"].get<int>();
+        checksum += received["user_defined"].get<light_update>().light_curr_state.size();
+    }
+    double jsonTime = chrono::duration<double>(chrono::steady_clock::now() - start).count() / NUM_EXCHANGES;
+
+    // Typed channel
+    string buffer;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < NUM_EXCHANGES; i++) {
+        carlaWriteGenericMessage(buffer, 1.0 * i, command);
+        checksum += buffer.size();
+        light_update received;
+        checksum += carlaReadGenericResponse(response.data(), response.size(), received);
+        checksum += received.light_curr_state.size();
+    }
+    double typedTime = chrono::duration<double>(chrono::steady_clock::now() - start).count() / NUM_EXCHANGES;
+
+    // Both paths must put the same text on the wire
+    json typedRequest = json::parse(buffer);
+    json jsonRequest = {{"message_type", "GENERIC_MESSAGE"}, {"timestamp", 1.0 * (NUM_EXCHANGES - 1)}, {"user_defined", command}};
+    if (typedRequest != jsonRequest) {
+        fprintf(stderr, "The typed and the json requests differ\n");
+        return 1;
+    }
+
+    printf("per exchange: json %.2f us, typed %.2f us (%.1fx) [%zu]\n", jsonTime * 1e6, typedTime * 1e6, jsonTime / typedTime, checksum);
+    return 0;
+}
@@ -0,0 +1,108 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+/*
+ * Benchmark of the spatial index of CarlanetManager (CarlaSpatialIndex) against brute force:
+ * 10k actors spread uniformly over 2km x 2km, 50m cells, 1000 random range and k-nearest
+ * queries. Every grid result is checked against the brute-force one.
+ *
+ * It is not part of the simulation library. Build it from the repository root, e.g.
+ *   g++ -std=c++14 -O2 -Isrc/carlanet -I$INET4_4_PROJ/src -I$__omnetpp_root_dir/include \
+ *       bench/SpatialIndexBench.cc -L$INET4_4_PROJ/src -lINET -L$__omnetpp_root_dir/lib -loppsim -loppcommon \
+ *       -o spatialIndexBench
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "CarlaSpatialIndex.h"
+
+using namespace std;
+
+static const int NUM_ACTORS = 10000;
+static const int NUM_QUERIES = 1000;
+
+static double elapsed(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static void check(bool condition, const char* what)
+{
+    if (!condition) {
+        fprintf(stderr, "Grid and brute force differ: %s\n", what);
+        exit(1);
+    }
+}
+
+int main()
+{
+    mt19937_64 random(3);
+    uniform_real_distribution<double> coordinate(0, 2000);
+
+    CarlaSpatialIndex index;
+    index.setCellSize(50);
+    vector<inet::Coord> positions(NUM_ACTORS);
+    for (int i = 0; i < NUM_ACTORS; i++) {
+        positions[i] = inet::Coord(coordinate(random), coordinate(random), 0);
+        index.update(i, positions[i]);
+    }
+
+    // A frame moving every actor by 1m
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < NUM_ACTORS; i++) {
+        positions[i].x += 1.0;
+        index.update(i, positions[i]);
+    }
+    double updateTime = elapsed(start);
+
+    vector<inet::Coord> centers(NUM_QUERIES);
+    for (auto& center : centers)
+        center = inet::Coord(coordinate(random), coordinate(random), 0);
+
+    for (double radius : {50.0, 200.0}) {
+        double bruteTime = 0, gridTime = 0;
+        for (auto const &center : centers) {
+            vector<int> brute, grid;
+            start = chrono::steady_clock::now();
+            for (int i = 0; i < NUM_ACTORS; i++)
+                if (positions[i].sqrdist(center) <= radius * radius)
+                    brute.push_back(i);
+            bruteTime += elapsed(start);
+            start = chrono::steady_clock::now();
+            index.getInRange(center, radius, grid);
+            gridTime += elapsed(start);
+            check(set<int>(brute.begin(), brute.end()) == set<int>(grid.begin(), grid.end()), "range");
+        }
+        printf("range r=%.0fm: brute %.1f us, grid %.1f us per query\n", radius, bruteTime / NUM_QUERIES * 1e6, gridTime / NUM_QUERIES * 1e6);
+    }
+
+    for (size_t k : {1, 10}) {
+        double bruteTime = 0, gridTime = 0;
+        for (auto const &center : centers) {
+            start = chrono::steady_clock::now();
+            vector<pair<double, int>> brute(NUM_ACTORS);
+            for (int i = 0; i < NUM_ACTORS; i++)
+                brute[i] = make_pair(positions[i].sqrdist(center), i);
+            partial_sort(brute.begin(), brute.begin() + k, brute.end());
+            bruteTime += elapsed(start);
+            vector<int> grid;
+            start = chrono::steady_clock::now();
+            index.getNearest(center, k, grid);
+            gridTime += elapsed(start);
+            check(grid.size() == k, "k-nearest count");
+            for (size_t j = 0; j < k; j++)
+                check(positions[grid[j]].sqrdist(center) == brute[j].first, "k-nearest distance");
+        }
+        printf("kNN k=%zu: brute %.1f us, grid %.1f us per query\n", k, bruteTime / NUM_QUERIES * 1e6, gridTime / NUM_QUERIES * 1e6);
+    }
+
+    printf("update of all the %d actors: %.2f ms\n", NUM_ACTORS, updateTime * 1e3);
+    return 0;
+}
@@ -0,0 +1,219 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+#ifndef CARLAACTORATTRIBUTES_H_
+#define CARLAACTORATTRIBUTES_H_
+
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../lib/json.hpp"
+
+/*
+ * Attributes of the actors (e.g. speed, steering, light state) streamed by CARLA with each frame,
+ * owned by CarlanetManager. The attributes are requested by name (see subscribe()) and are sent only
+ * for the subscribed actors, as columns:
+ *     {"actor_ids": ["car1", "car2"], "speed": [13.2, 0.0], "light_state": ["green", "red"]}
+ * (an actor missing from a frame keeps its last values).
+ *
+ * The values are kept in columns too, one for each attribute, with a row for each actor.
+ * Numbers are stored as doubles, other values (strings, objects, ...) as json.
+ */
+class CarlaActorAttributes
+{
+public:
+    typedef int AttributeId;
+
+    /**
+     * Subscribes to the attribute for the given actor, or for all the actors if actorId is empty.
+     * Returns the id of the attribute, for the fast reads.
+     */
+    AttributeId subscribe(const std::string& attribute, const std::string& actorId = "") {
+        AttributeId id = getOrAddAttribute(attribute);
+        auto& actors = subscriptions[attribute];
+        if (!actors.allActors) {
+            if (actorId.empty()) {
+                actors.allActors = true;
+                actors.actorIds.clear();
+                subscriptionsChanged = true;
+            }
+            else if (actors.actorIds.insert(actorId).second)
+                subscriptionsChanged = true;
+        }
+        return id;
+    }
+
+    bool empty() const { return subscriptions.empty(); }
+
+    /**
+     * Subscriptions as sent to CARLA: attribute name -> list of actor ids, null for all the actors.
+     * Clears the change flag (see hasSubscriptionsChanged()).
+     */
+    nlohmann::json getSubscriptions() {
+        subscriptionsChanged = false;
+        nlohmann::json result = nlohmann::json::object();
+        for (auto const &item : subscriptions)
+            result[item.first] = item.second.allActors ? nlohmann::json() : nlohmann::json(item.second.actorIds);
+        return result;
+    }
+
+    bool hasSubscriptionsChanged() const { return subscriptionsChanged; }
+
+    // Stores the columns of a frame (see the class description)
+    void update(const nlohmann::json& frame) {
+        if (frame.is_null())
+            return;
+        auto const &actorIds = frame.at("actor_ids");
+        rows.resize(actorIds.size());
+        for (size_t i = 0; i < actorIds.size(); i++)
+            rows[i] = getOrAddActor(actorIds[i].get_ref<const std::string&>());
+        for (auto item = frame.begin(); item != frame.end(); ++item) {
+            if (item.key() == "actor_ids")
+                continue;
+            auto const &values = item.value();
+            if (values.size() != rows.size())
+                throw std::runtime_error("Actor attribute column '" + item.key() + "' does not match actor_ids");
+            Column& column = columns[getOrAddAttribute(item.key())];
+            for (size_t i = 0; i < rows.size(); i++) {
+                size_t row = rows[i];
+                auto const &value = values[i];
+                column.present[row] = true;
+                if (value.is_number()) {
+                    column.numbers[row] = value.get<double>();
+                    column.isNumber[row] = true;
+                }
+                else {
+                    column.others[row] = value;
+                    column.isNumber[row] = false;
+                }
+            }
+        }
+    }
+
+    // Forgets the subscriptions and the values of a destroyed actor (the last row is moved into its place)
+    void removeActor(const std::string& actorId) {
+        for (auto item = subscriptions.begin(); item != subscriptions.end();) {
+            if (item->second.actorIds.erase(actorId) > 0) {
+                subscriptionsChanged = true;
+                if (item->second.actorIds.empty()) {
+                    item = subscriptions.erase(item);  // no actor left: CARLA stops sending the attribute
+                    continue;
+                }
+            }
+            ++item;
+        }
+        auto it = actorRows.find(actorId);
+        if (it == actorRows.end())
+            return;
+        size_t row = it->second;
+        size_t last = rowActors.size() - 1;
+        if (row != last) {
+            actorRows[rowActors[last]] = row;
+            rowActors[row] = rowActors[last];
+            for (auto& column : columns)
+                column.moveRow(last, row);
+        }
+        actorRows.erase(it);
+        rowActors.pop_back();
+        for (auto& column : columns)
+            column.resize(last);
+    }
+
+    // Id of the attribute, or -1 if it has never been subscribed or received
+    AttributeId getAttributeId(const std::string& attribute) const {
+        auto it = attributeIds.find(attribute);
+        return it != attributeIds.end() ? it->second : -1;
+    }
+
+    // True if a value of the attribute has been received for the actor
+    bool has(const std::string& actorId, AttributeId attribute) const {
+        auto it = actorRows.find(actorId);
+        return attribute >= 0 && it != actorRows.end() && columns[attribute].present[it->second];
+    }
+
+    // Numeric value of the attribute for the actor (the default if not received or not a number)
+    double getNumber(const std::string& actorId, AttributeId attribute, double defaultValue = 0) const {
+        auto it = actorRows.find(actorId);
+        if (attribute < 0 || it == actorRows.end())
+            return defaultValue;
+        auto const &column = columns[attribute];
+        return column.present[it->second] && column.isNumber[it->second] ? column.numbers[it->second] : defaultValue;
+    }
+
+    // Value of the attribute for the actor, as json (null if not received)
+    nlohmann::json getJson(const std::string& actorId, AttributeId attribute) const {
+        auto it = actorRows.find(actorId);
+        if (attribute < 0 || it == actorRows.end() || !columns[attribute].present[it->second])
+            return nlohmann::json();
+        auto const &column = columns[attribute];
+        return column.isNumber[it->second] ? nlohmann::json(column.numbers[it->second]) : column.others[it->second];
+    }
+
+    // Whole numeric column of the attribute, indexed by row (see getActorIds()), for whole-fleet computations
+    const std::vector<double>& getNumbers(AttributeId attribute) const { return columns[attribute].numbers; }
+    const std::vector<std::string>& getActorIds() const { return rowActors; }
+
+private:
+    struct Subscription {
+        bool allActors = false;
+        std::set<std::string> actorIds;
+    };
+
+    struct Column {
+        std::vector<double> numbers;
+        std::vector<nlohmann::json> others;
+        std::vector<bool> isNumber;
+        std::vector<bool> present;
+
+        void resize(size_t size) {
+            numbers.resize(size, 0);
+            others.resize(size);
+            isNumber.resize(size, false);
+            present.resize(size, false);
+        }
+
+        void moveRow(size_t from, size_t to) {
+            numbers[to] = numbers[from];
+            others[to] = std::move(others[from]);
+            isNumber[to] = isNumber[from];
+            present[to] = present[from];
+        }
+    };
+
+    AttributeId getOrAddAttribute(const std::string& attribute) {
+        auto it = attributeIds.find(attribute);
+        if (it != attributeIds.end())
+            return it->second;
+        AttributeId id = columns.size();
+        attributeIds[attribute] = id;
+        columns.emplace_back();
+        columns.back().resize(rowActors.size());
+        return id;
+    }
+
+    size_t getOrAddActor(const std::string& actorId) {
+        auto it = actorRows.find(actorId);
+        if (it != actorRows.end())
+            return it->second;
+        size_t row = rowActors.size();
+        actorRows[actorId] = row;
+        rowActors.push_back(actorId);
+        for (auto& column : columns)
+            column.resize(row + 1);
+        return row;
+    }
+
+    std::map<std::string, Subscription> subscriptions;
+    bool subscriptionsChanged = false;
+    std::unordered_map<std::string, AttributeId> attributeIds;
+    std::vector<Column> columns;  // by attribute id
+    std::unordered_map<std::string, size_t> actorRows;
+    std::vector<std::string> rowActors;  // by row
+    std::vector<size_t> rows;  // rows of the actors of the frame being stored
+};
+
+#endif
@@ -0,0 +1,95 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+#ifndef CARLAACTORCONFIGURATION_H_
+#define CARLAACTORCONFIGURATION_H_
+
+#include <string>
+#include <memory>
+#include <unordered_map>
+
+#include "omnetpp.h"
+#include "../lib/json.hpp"
+
+using namespace omnetpp;
+using json = nlohmann::json;
+
+/*
+ * Immutable CARLA actor configuration shared by all the actors with identical configuration.
+ * Instances are interned by CarlaActorConfigurationPool: the conversion to json and the serialized
+ * form are computed once per distinct configuration, not once per actor.
+ */
+class CarlaActorConfiguration
+{
+public:
+    CarlaActorConfiguration(const std::string& name, json configuration, std::string serialized)
+        : name(name), configuration(std::move(configuration)), serialized(std::move(serialized)) {}
+
+    // Name of the configuration, used as template name in the INIT message
+    const std::string& getName() const { return name; }
+
+    const json& getJson() const { return configuration; }
+
+    const std::string& getSerialized() const { return serialized; }
+
+private:
+    const std::string name;
+    const json configuration;
+    const std::string serialized;
+};
+
+
+/*
+ * Interning pool of the CARLA actor configurations, owned by CarlanetManager.
+ */
+class CarlaActorConfigurationPool
+{
+public:
+    /**
+     * Returns the shared configuration equal to the given map, creating it if needed.
+     * The modules whose parameter has the same value usually share the map object, so the
+     * map is converted and serialized only the first time it is seen.
+     */
+    const CarlaActorConfiguration* intern(const cValueMap* configurationMap) {
+        numInternRequests++;
+        auto known = byMap.find(configurationMap);
+        if (known == byMap.end()) {
+            json configuration = configurationMap->getFields();
+            std::string serialized = configuration.dump();
+            auto it = configurations.find(serialized);
+            if (it == configurations.end()) {
+                std::string name = "template_" + std::to_string(configurations.size());
+                auto shared = std::unique_ptr<CarlaActorConfiguration>(new CarlaActorConfiguration(name, std::move(configuration), serialized));
+                serializedBytes += serialized.size();
+                it = configurations.emplace(std::move(serialized), std::move(shared)).first;
+            }
+            known = byMap.emplace(configurationMap, it->second.get()).first;
+        }
+        unsharedBytes += known->second->getSerialized().size();
+        return known->second;
+    }
+
+    // Forgets the map, which is about to be deleted with its module (its address may be reused)
+    void release(const cValueMap* configurationMap) { byMap.erase(configurationMap); }
+
+    // Number of distinct configurations
+    size_t size() const { return configurations.size(); }
+
+    // Number of configurations interned (i.e. of actors sharing them)
+    size_t getNumInternRequests() const { return numInternRequests; }
+
+    // Size of the serialized form of the distinct configurations
+    size_t getSerializedBytes() const { return serializedBytes; }
+
+    // Size of the serialized form of all the interned configurations, if they were not shared
+    size_t getUnsharedBytes() const { return unsharedBytes; }
+
+private:
+    std::unordered_map<std::string, std::unique_ptr<CarlaActorConfiguration>> configurations;
+    std::unordered_map<const cValueMap*, const CarlaActorConfiguration*> byMap;
+    size_t numInternRequests = 0;
+    size_t serializedBytes = 0;
+    size_t unsharedBytes = 0;
+};
+
+#endif
@@ -0,0 +1,63 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+#ifndef CARLABOX_H_
+#define CARLABOX_H_
+
+#include <algorithm>
+#include <cmath>
+
+#include "inet/common/geometry/common/Coord.h"
+#include "inet/common/geometry/common/Quaternion.h"
+
+/*
+ * Oriented box, as the bounding boxes of CARLA: centre, half extents and orientation.
+ */
+struct CarlaBox
+{
+    inet::Coord center;
+    inet::Coord halfExtent;
+    inet::Quaternion inverseOrientation;  // from the world frame to the frame of the box
+
+    void setOrientation(const inet::Quaternion& orientation) { inverseOrientation = orientation.conjugated(); }
+
+    bool contains(const inet::Coord& point) const {
+        inet::Coord local = inverseOrientation.rotate(point - center);
+        return std::fabs(local.x) <= halfExtent.x && std::fabs(local.y) <= halfExtent.y && std::fabs(local.z) <= halfExtent.z;
+    }
+
+    // Half size of the axis-aligned box enclosing this one
+    inet::Coord getEnclosingHalfExtent() const {
+        inet::Quaternion orientation = inverseOrientation.conjugated();
+        inet::Coord ex = orientation.rotate(inet::Coord(halfExtent.x, 0, 0));
+        inet::Coord ey = orientation.rotate(inet::Coord(0, halfExtent.y, 0));
+        inet::Coord ez = orientation.rotate(inet::Coord(0, 0, halfExtent.z));
+        return inet::Coord(std::fabs(ex.x) + std::fabs(ey.x) + std::fabs(ez.x),
+                           std::fabs(ex.y) + std::fabs(ey.y) + std::fabs(ez.y),
+                           std::fabs(ex.z) + std::fabs(ey.z) + std::fabs(ez.z));
+    }
+
+    // Length of the part of the segment between a and b inside the box (slab test in the frame of the box)
+    double getCrossingLength(const inet::Coord& a, const inet::Coord& b) const {
+        inet::Coord localA = inverseOrientation.rotate(a - center);
+        inet::Coord direction = inverseOrientation.rotate(b - center) - localA;
+        double origin[3] = {localA.x, localA.y, localA.z};
+        double delta[3] = {direction.x, direction.y, direction.z};
+        double extent[3] = {halfExtent.x, halfExtent.y, halfExtent.z};
+        double tMin = 0, tMax = 1;
+        for (int i = 0; i < 3; i++) {
+            if (delta[i] == 0) {
+                if (std::fabs(origin[i]) > extent[i])
+                    return 0;
+                continue;
+            }
+            double t0 = (-extent[i] - origin[i]) / delta[i];
+            double t1 = (extent[i] - origin[i]) / delta[i];
+            tMin = std::max(tMin, std::min(t0, t1));
+            tMax = std::min(tMax, std::max(t0, t1));
+        }
+        return tMax > tMin ? (tMax - tMin) * direction.length() : 0;
+    }
+};
+
+#endif
@@ -0,0 +1,73 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+
+#include "CarlaCachedPathLoss.h"
+
+#include "inet/physicallayer/wireless/common/contract/packetlevel/IArrival.h"
+#include "inet/physicallayer/wireless/common/contract/packetlevel/ISignalAnalogModel.h"
+#include "inet/physicallayer/wireless/common/contract/packetlevel/ITransmission.h"
+
+#include "CarlanetManager.h"
+#include "utils.h"
+
+Define_Module(CarlaCachedPathLoss);
+
+using namespace inet;
+
+static simsignal_t carlaStepCompletedSignal = cComponent::registerSignal("carlaStepCompleted");
+
+
+void CarlaCachedPathLoss::initialize(int stage){
+    cModule::initialize(stage);
+    if (stage == INITSTAGE_LOCAL){
+        pathLoss = check_and_cast<IPathLoss *>(getSubmodule("pathLoss"));
+        cModule* root = getSimulation()->getSystemModule();
+        auto carlanetManager = dynamic_cast<CarlanetManager*>(root->getSubmodule(par("carlanetManagerModule").stringValue()));
+        if (carlanetManager == nullptr)
+            carlanetManager = getFirstSubmoduleOfType<CarlanetManager>(root);
+        if (carlanetManager == nullptr)
+            throw cRuntimeError("CarlanetManager not found in the network");
+        // The cache is cleared only by the bulk notification, otherwise it would grow forever
+        if (!carlanetManager->isStepCompletedSignalEmitted())
+            throw cRuntimeError("CarlaCachedPathLoss requires stepNotification \"bulk\" or \"both\" in %s", carlanetManager->getFullPath().c_str());
+        root->subscribe(carlaStepCompletedSignal, this);
+    }
+}
+
+void CarlaCachedPathLoss::finish(){
+    recordScalar("numCacheHits", cache.getNumHits());
+    recordScalar("numCacheMisses", cache.getNumMisses());
+}
+
+void CarlaCachedPathLoss::receiveSignal(cComponent *source, simsignal_t signalID, cObject *obj, cObject *details){
+    if (signalID == carlaStepCompletedSignal)
+        cache.clear();
+}
+
+double CarlaCachedPathLoss::computePathLoss(const ITransmission *transmission, const IArrival *arrival) const{
+    auto narrowbandSignal = dynamic_cast<const INarrowbandSignal *>(transmission->getAnalogModel());
+    if (narrowbandSignal == nullptr)
+        return pathLoss->computePathLoss(transmission, arrival);  // no frequency to key the cache with
+    double frequency = narrowbandSignal->getCenterFrequency().get();
+    const Coord& transmissionPosition = transmission->getStartPosition();
+    const Coord& arrivalPosition = arrival->getStartPosition();
+    if (auto cached = cache.find(transmissionPosition, arrivalPosition, frequency))
+        return *cached;
+    double loss = pathLoss->computePathLoss(transmission, arrival);
+    cache.insert(transmissionPosition, arrivalPosition, frequency, loss);
+    return loss;
+}
+
+double CarlaCachedPathLoss::computePathLoss(mps propagationSpeed, Hz frequency, m distance) const{
+    return pathLoss->computePathLoss(propagationSpeed, frequency, distance);
+}
+
+m CarlaCachedPathLoss::computeRange(mps propagationSpeed, Hz frequency, double loss) const{
+    return pathLoss->computeRange(propagationSpeed, frequency, loss);
+}
+
+std::ostream& CarlaCachedPathLoss::printToStream(std::ostream& stream, int level, int evFlags) const{
+    stream << "CarlaCachedPathLoss, pathLoss = ";
+    return pathLoss->printToStream(stream, level, evFlags);
+}
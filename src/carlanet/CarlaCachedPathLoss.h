@@ -0,0 +1,35 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+#ifndef CARLACACHEDPATHLOSS_H_
+#define CARLACACHEDPATHLOSS_H_
+
+#include <omnetpp.h>
+#include "inet/physicallayer/wireless/common/contract/packetlevel/IPathLoss.h"
+#include "CarlaLinkCache.h"
+
+using namespace omnetpp;
+using namespace inet::physicallayer;
+
+/*
+ * Path loss cached per CARLA step (see the NED file).
+ */
+class CarlaCachedPathLoss : public cModule, public IPathLoss, public cListener
+{
+public:
+    virtual double computePathLoss(const ITransmission *transmission, const IArrival *arrival) const override;
+    virtual double computePathLoss(inet::mps propagationSpeed, inet::Hz frequency, inet::m distance) const override;
+    virtual inet::m computeRange(inet::mps propagationSpeed, inet::Hz frequency, double loss) const override;
+    virtual std::ostream& printToStream(std::ostream& stream, int level, int evFlags = 0) const override;
+
+protected:
+    virtual int numInitStages() const override { return inet::NUM_INIT_STAGES; }
+    virtual void initialize(int stage) override;
+    virtual void finish() override;
+    virtual void receiveSignal(cComponent *source, simsignal_t signalID, cObject *obj, cObject *details) override;
+
+    const IPathLoss *pathLoss = nullptr;
+    mutable CarlaLinkCache<double> cache;
+};
+
+#endif
@@ -4,66 +4,284 @@
 
 #include "CarlaInetMobility.h"
 
+#include <cmath>
+
 #include "CarlanetManager.h"
 
 #include "utils.h"
 
 Define_Module(CarlaInetMobility);
 
+static simsignal_t extrapolationErrorSignal = cComponent::registerSignal("extrapolationError");
+
+// Below this speed (m/s) the heading given by the velocity is meaningless
+static const double MIN_HEADING_SPEED = 0.5;
+
+// Rotation from one orientation to another one, as axis scaled by the rotation rate
+static inet::Coord getRotationRate(const inet::Quaternion& from, const inet::Quaternion& to, double dt)
+{
+    inet::Quaternion delta = to * inet::Quaternion(from.s, -from.v.x, -from.v.y, -from.v.z);
+    if (delta.s < 0)  // shortest rotation
+        delta = inet::Quaternion(-delta.s, -delta.v.x, -delta.v.y, -delta.v.z);
+    double sinHalfAngle = delta.v.length();
+    if (sinHalfAngle < 1e-12 || dt <= 0)
+        return inet::Coord::ZERO;
+    double angle = 2 * std::atan2(sinHalfAngle, delta.s);
+    return delta.v * (angle / (sinHalfAngle * dt));
+}
+
+// Inverse of getRotationRate(): rotation in one second
+static inet::Quaternion getRotationQuaternion(const inet::Coord& rate)
+{
+    double angle = rate.length();
+    if (angle < 1e-12)
+        return inet::Quaternion::IDENTITY;
+    return inet::Quaternion(rate / angle, angle);
+}
+
 void CarlaInetMobility::initialize(int stage)
 {
     MobilityBase::initialize(stage);
 
     if (stage == inet::INITSTAGE_LOCAL){
         carlaActorType = par("carlaActorType").stdstringValue();
+        string mode = par("extrapolationMode").stdstringValue();
+        if (mode == "linear")
+            extrapolationMode = EXTRAPOLATION_LINEAR;
+        else if (mode == "ctra")
+            extrapolationMode = EXTRAPOLATION_CTRA;
+        maxExtrapolationTime = par("maxExtrapolationTime");
+        motionHistorySize = std::max(2, (int) par("motionHistorySize"));
+        lastAngularVelocity = inet::Quaternion::IDENTITY;
+        lastAngularAcceleration = inet::Quaternion::IDENTITY;
+        positionDeadBand = par("positionDeadBand");
+        orientationDeadBand = par("orientationDeadBand").doubleValueInUnit("rad");
+        skipInDeadBand = par("deadBandAction").stdstringValue() == "skip";
+        maxSuppressedNotifications = par("maxSuppressedNotifications");
+        WATCH(numSuppressedNotifications);
         carlaActorConfiguration = check_and_cast<cValueMap*>(par("carlaActorConfiguration").objectValue()); //.cValueMap(); // .objectValue();
         updateCarlaActorConfigurationFromParam(carlaActorConfiguration);
-        auto carlaManager = getFirstSubmoduleOfType<CarlanetManager>(getModuleByPath("<root>"));
+        // Well-known path first: searching the whole network for every mobility module is quadratic in the number of nodes
+        cModule* root = getSimulation()->getSystemModule();
+        auto carlaManager = dynamic_cast<CarlanetManager*>(root->getSubmodule(par("carlanetManagerModule").stringValue()));
+        if (carlaManager == nullptr)
+            carlaManager = getFirstSubmoduleOfType<CarlanetManager>(root);
+        if (carlaManager == nullptr)
+            throw cRuntimeError("CarlanetManager not found in the network");
+        sharedCarlaActorConfiguration = carlaManager->internActorConfiguration(carlaActorConfiguration);
         // register to carlaManager
         carlaManager->registerMobilityModule(this);
+        carlanetManager = carlaManager;
     }
 }
 
+CarlaActorAttributes::AttributeId CarlaInetMobility::subscribeCarlaAttribute(const std::string& attribute){
+    return carlanetManager->subscribeActorAttribute(attribute, getParentModule()->getFullName());
+}
+
+double CarlaInetMobility::getCarlaAttribute(CarlaActorAttributes::AttributeId attribute, double defaultValue) const{
+    return carlanetManager->getActorAttributes().getNumber(getParentModule()->getFullName(), attribute, defaultValue);
+}
+
+void CarlaInetMobility::finish(){
+    MobilityBase::finish();
+    recordScalar("numSuppressedNotifications", numSuppressedNotifications);
+}
+
 void CarlaInetMobility::setInitialPosition(){
     if (!preInitialized){
         MobilityBase::setInitialPosition();
+        lastNotifiedPosition = samplePosition = lastPosition;
+        lastNotifiedOrientation = sampleOrientation = lastOrientation;
+        sampleVelocity = lastVelocity;
+        sampleTime = lastUpdate = simTime();
+        if (carlanetManager != nullptr && poseStoreHandle >= 0)
+            carlanetManager->seedActorPose(this);  // registered before its initial position was known
     }
 }
 
 void CarlaInetMobility::preInitialize(const inet::Coord& position, const inet::Coord& velocity,  const inet::Quaternion& rotation){
     preInitialized = true;
-    lastPosition = position;
-    lastVelocity = velocity;
-    lastOrientation = rotation;
+    lastNotifiedPosition = position;
+    lastNotifiedOrientation = rotation;
+    lastPosition = samplePosition = position;
+    lastVelocity = sampleVelocity = velocity;
+    lastOrientation = sampleOrientation = rotation;
+    sampleTime = lastUpdate = simTime();
+    motionHistory.push_back({sampleTime, velocity, rotation, inet::Coord::ZERO});
+}
+
+
+bool CarlaInetMobility::nextPosition(const inet::Coord& position, const inet::Coord& velocity,  const inet::Quaternion& rotation){
+    return nextPosition(position, velocity, rotation, nullptr, nullptr);
+}
+
+bool CarlaInetMobility::nextPosition(const inet::Coord& position, const inet::Coord& velocity, const inet::Quaternion& rotation,
+                                     const inet::Coord* acceleration, const inet::Coord* angularVelocity){
+    simtime_t now = simTime();
+    bool suppressNotification = (positionDeadBand > 0 || orientationDeadBand > 0) && isInDeadBand(position, rotation) &&
+            (maxSuppressedNotifications <= 0 || numConsecutiveSuppressed < maxSuppressedNotifications);
+    if (suppressNotification){
+        numConsecutiveSuppressed++;
+        numSuppressedNotifications++;
+        if (skipInDeadBand)
+            return false;
+    }
+
+    if (now > sampleTime && mayHaveListeners(extrapolationErrorSignal)){
+        inet::Coord predictedPosition, predictedVelocity;
+        inet::Quaternion predictedOrientation;
+        extrapolate(now, predictedPosition, predictedVelocity, predictedOrientation);
+        emit(extrapolationErrorSignal, predictedPosition.distance(position));
+    }
+    // Whatever the extrapolation mode, so that getCurrentAcceleration() & co. always report the motion
+    estimateMotion(velocity, rotation, now, acceleration, angularVelocity);
+
+    lastPosition = samplePosition = position;
+    lastVelocity = sampleVelocity = velocity;
+    lastOrientation = sampleOrientation = rotation;
+    sampleTime = lastUpdate = now;
+
+    if (suppressNotification)
+        return false;
+    numConsecutiveSuppressed = 0;
+    lastNotifiedPosition = position;
+    lastNotifiedOrientation = rotation;
+    if (stepNotification)
+        emitMobilityStateChangedSignal();
+    return true;
+}
+
+
+bool CarlaInetMobility::isInDeadBand(const inet::Coord& position, const inet::Quaternion& rotation) const{
+    if (position.distance(lastNotifiedPosition) > positionDeadBand)
+        return false;
+    // Angle of the rotation between the two orientations
+    double dot = rotation.s * lastNotifiedOrientation.s + rotation.v.x * lastNotifiedOrientation.v.x +
+                 rotation.v.y * lastNotifiedOrientation.v.y + rotation.v.z * lastNotifiedOrientation.v.z;
+    double angle = 2 * std::acos(std::min(1.0, std::fabs(dot)));
+    return angle <= orientationDeadBand;
+}
+
+
+void CarlaInetMobility::estimateMotion(const inet::Coord& velocity, const inet::Quaternion& rotation, simtime_t time,
+                                       const inet::Coord* acceleration, const inet::Coord* angularVelocity){
+    if (!motionHistory.empty() && time <= motionHistory.back().time)
+        motionHistory.pop_back();  // a newer pose for the same time replaces the old one
+    MotionSample sample = {time, velocity, rotation, inet::Coord::ZERO};
+    if (angularVelocity != nullptr)
+        sample.angularRate = *angularVelocity;
+    else if (!motionHistory.empty())
+        sample.angularRate = getRotationRate(motionHistory.back().orientation, rotation, (time - motionHistory.back().time).dbl());
+    motionHistory.push_back(sample);
+    while ((int) motionHistory.size() > motionHistorySize)
+        motionHistory.pop_front();
+
+    if (acceleration != nullptr)
+        lastAcceleration = *acceleration;
+    if (angularVelocity != nullptr)
+        lastAngularVelocity = getRotationQuaternion(*angularVelocity);
+    if (motionHistory.size() < 2)
+        return;
+
+    // Finite differences over the whole window
+    const MotionSample& first = motionHistory.front();
+    double dt = (time - first.time).dbl();
+    if (acceleration == nullptr)
+        lastAcceleration = (velocity - first.velocity) / dt;
+    if (angularVelocity == nullptr)
+        lastAngularVelocity = getRotationQuaternion(getRotationRate(first.orientation, rotation, dt));
+    // The rate of the oldest sample refers to the step before the window, unless it is provided by CARLA
+    const MotionSample& firstRate = (angularVelocity != nullptr || motionHistory.size() < 3) ? first : motionHistory[1];
+    double rateDt = (time - firstRate.time).dbl();
+    if (rateDt > 0 && (angularVelocity != nullptr || motionHistory.size() >= 3))
+        lastAngularAcceleration = getRotationQuaternion((sample.angularRate - firstRate.angularRate) / rateDt);
+
+    if (std::hypot(velocity.x, velocity.y) > MIN_HEADING_SPEED && std::hypot(first.velocity.x, first.velocity.y) > MIN_HEADING_SPEED){
+        double headingChange = std::atan2(velocity.y, velocity.x) - std::atan2(first.velocity.y, first.velocity.x);
+        estimatedYawRate = std::remainder(headingChange, 2 * M_PI) / dt;
+    }
+    else{
+        estimatedYawRate = 0;
+    }
 }
 
 
-void CarlaInetMobility::nextPosition(const inet::Coord& position, const inet::Coord& velocity,  const inet::Quaternion& rotation){
-    lastPosition = position;
-    lastVelocity = velocity;
-    lastOrientation = rotation;
+void CarlaInetMobility::extrapolate(simtime_t time, inet::Coord& position, inet::Coord& velocity, inet::Quaternion& orientation) const{
+    double dt = std::min(time - sampleTime, maxExtrapolationTime).dbl();
+    if (extrapolationMode == EXTRAPOLATION_NONE || dt <= 0){
+        position = samplePosition;
+        velocity = sampleVelocity;
+        orientation = sampleOrientation;
+        return;
+    }
+    if (extrapolationMode == EXTRAPOLATION_LINEAR){
+        position = samplePosition + sampleVelocity * dt;
+        velocity = sampleVelocity;
+        orientation = sampleOrientation;
+        return;
+    }
+
+    // Constant turn rate and (tangential) acceleration on the horizontal plane
+    double speed = std::hypot(sampleVelocity.x, sampleVelocity.y);
+    double heading = std::atan2(sampleVelocity.y, sampleVelocity.x);
+    double acceleration = 0;
+    if (speed > MIN_HEADING_SPEED)
+        acceleration = (lastAcceleration.x * sampleVelocity.x + lastAcceleration.y * sampleVelocity.y) / speed;
+    if (acceleration < 0)
+        dt = std::min(dt, -speed / acceleration);  // the actor stops, it does not go backwards
+    double w = estimatedYawRate;
+    double finalSpeed = speed + acceleration * dt;
+    double finalHeading = heading + w * dt;
+
+    position = samplePosition;
+    if (std::fabs(w) < 1e-6){
+        double distance = speed * dt + 0.5 * acceleration * dt * dt;
+        position.x += distance * std::cos(heading);
+        position.y += distance * std::sin(heading);
+    }
+    else{
+        position.x += (finalSpeed * w * std::sin(finalHeading) + acceleration * std::cos(finalHeading)
+                       - speed * w * std::sin(heading) - acceleration * std::cos(heading)) / (w * w);
+        position.y += (-finalSpeed * w * std::cos(finalHeading) + acceleration * std::sin(finalHeading)
+                       + speed * w * std::cos(heading) - acceleration * std::sin(heading)) / (w * w);
+    }
+    position.z += sampleVelocity.z * dt;
+    velocity = inet::Coord(finalSpeed * std::cos(finalHeading), finalSpeed * std::sin(finalHeading), sampleVelocity.z);
+    orientation = inet::Quaternion(inet::Coord(0, 0, 1), w * dt) * sampleOrientation;
+}
+
 
+void CarlaInetMobility::moveAndUpdate(){
+    simtime_t now = simTime();
+    if (extrapolationMode == EXTRAPOLATION_NONE || now == lastUpdate)
+        return;
+    extrapolate(now, lastPosition, lastVelocity, lastOrientation);
+    lastUpdate = now;
     emitMobilityStateChangedSignal();
 }
 
 
 const inet::Coord& CarlaInetMobility::getCurrentPosition()
 {
+    moveAndUpdate();
     return lastPosition;
 }
 
 const inet::Coord& CarlaInetMobility::getCurrentVelocity()
 {
+    moveAndUpdate();
     return lastVelocity;
 }
 
 const inet::Coord& CarlaInetMobility::getCurrentAcceleration()
 {
-    throw cRuntimeError("Invalid operation");
+    return lastAcceleration;
 }
 
 const inet::Quaternion& CarlaInetMobility::getCurrentAngularPosition()
 {
+    moveAndUpdate();
     return lastOrientation;
 }
 
@@ -74,7 +292,7 @@ const inet::Quaternion& CarlaInetMobility::getCurrentAngularVelocity()
 
 const inet::Quaternion& CarlaInetMobility::getCurrentAngularAcceleration()
 {
-    throw cRuntimeError("Invalid operation");
+    return lastAngularAcceleration;
 }
 
 
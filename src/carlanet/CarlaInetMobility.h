@@ -6,8 +6,12 @@
 #define CARLAINETMOBILITY_H_
 
 
+#include <deque>
 #include <omnetpp.h>
 #include "inet/mobility/base/MobilityBase.h"
+#include "CarlaActorConfiguration.h"
+#include "CarlaPoseStore.h"
+#include "CarlaActorAttributes.h"
 
 using namespace omnetpp;
 using namespace std;
@@ -21,6 +25,8 @@ using namespace std;
  * It is mandatory to set the mobilityType for Carla mobile actors in order to properly configure their mobility behavior.
  */
 
+class CarlanetManager;
+
 class CarlaInetMobility : public inet::MobilityBase
 {
 public:
@@ -30,8 +36,27 @@ public:
     // Overrides the base class function to perform initialization tasks at a specified stage.
     virtual void initialize(int stage) override;
 
+    virtual void finish() override;
+
     // Update the position, velocity, and rotation of the actor for the next step.
-    virtual void nextPosition(const inet::Coord& position, const inet::Coord& velocity, const inet::Quaternion& rotation);
+    // Returns true if the change is notified, i.e. it is not suppressed by the dead-band.
+    virtual bool nextPosition(const inet::Coord& position, const inet::Coord& velocity, const inet::Quaternion& rotation);
+
+    // Same as above, with the acceleration and/or the angular velocity provided by CARLA instead of being estimated (nullptr if not provided).
+    // The angular velocity is the rotation axis scaled by the rate, in rad/s.
+    virtual bool nextPosition(const inet::Coord& position, const inet::Coord& velocity, const inet::Quaternion& rotation,
+                              const inet::Coord* acceleration, const inet::Coord* angularVelocity);
+
+    // Enables/disables the mobilityStateChanged signal of the CARLA steps, for when the changes
+    // are notified in bulk by the CarlanetManager (see CarlaStepNotification).
+    void setStepNotification(bool enabled) { stepNotification = enabled; }
+
+    // True if the steps in the dead-band are ignored (deadBandAction "skip"), i.e. nextPosition() returns false only for them
+    bool isSkippingInDeadBand() const { return skipInDeadBand; }
+
+    // Handle of the actor in the pose store of the CarlanetManager (-1 if not registered yet)
+    CarlaPoseStore::Handle getPoseStoreHandle() const { return poseStoreHandle; }
+    void setPoseStoreHandle(CarlaPoseStore::Handle handle) { poseStoreHandle = handle; }
 
     // Returns the current position of the actor.
     virtual const inet::Coord& getCurrentPosition() override;
@@ -58,10 +83,33 @@ public:
     // This method is used by the CarlanetManager to retrieve the configuration for a specific actor that needs to be sent to pycarlanet.
     const cValueMap* getCarlaActorConfiguration() { return carlaActorConfiguration; }
 
+    // Returns the configuration of the Carla actor as shared (interned) object.
+    // Actors with identical configuration return the same object, so its conversion to json is done only once.
+    const CarlaActorConfiguration* getSharedCarlaActorConfiguration() { return sharedCarlaActorConfiguration; }
+
 protected:
+    enum ExtrapolationMode {
+        EXTRAPOLATION_NONE,
+        EXTRAPOLATION_LINEAR,
+        EXTRAPOLATION_CTRA
+    };
+
     // This must be implemented as described in MobilityBase.
     virtual void handleSelfMessage(cMessage* msg) override;
 
+    // Updates the current pose to simTime(), at most once per event (same convention as INET's MovingMobilityBase).
+    virtual void moveAndUpdate();
+
+    // Computes the pose at the given time from the pose of the last step.
+    virtual void extrapolate(simtime_t time, inet::Coord& position, inet::Coord& velocity, inet::Quaternion& orientation) const;
+
+    // Adds the new pose to the motion history and estimates acceleration, angular velocity,
+    // angular acceleration and yaw rate from it. Values provided by CARLA are used as they are.
+    // Called for every step, also with extrapolationMode "none" (which only disables extrapolate()).
+    virtual void estimateMotion(const inet::Coord& velocity, const inet::Quaternion& rotation, simtime_t time,
+                                const inet::Coord* acceleration = nullptr, const inet::Coord* angularVelocity = nullptr);
+
+
     // Overrides the base class function to set the initial position of the actor.
     virtual void setInitialPosition() override;
 
@@ -71,12 +119,60 @@ protected:
     inet::Coord lastVelocity;
     inet::Quaternion lastAngularVelocity;
 
+    // Pose reported by CARLA in the last step, starting point of the extrapolation
+    simtime_t sampleTime;
+    inet::Coord samplePosition;
+    inet::Coord sampleVelocity;
+    inet::Quaternion sampleOrientation;
+    double estimatedYawRate = 0;  // rad/s, of the velocity
+
+    // Steps used for the finite-difference estimates
+    struct MotionSample {
+        simtime_t time;
+        inet::Coord velocity;
+        inet::Quaternion orientation;
+        inet::Coord angularRate;  // rotation axis scaled by rad/s, since the previous sample
+    };
+    std::deque<MotionSample> motionHistory;
+    int motionHistorySize;
+    inet::Coord lastAcceleration;
+    inet::Quaternion lastAngularAcceleration;
+
+    // Returns true if the new pose is within the dead-band of the last notified one.
+    virtual bool isInDeadBand(const inet::Coord& position, const inet::Quaternion& rotation) const;
+
+    // Dead-band of the mobilityStateChanged notifications
+    double positionDeadBand;
+    double orientationDeadBand;  // rad
+    bool skipInDeadBand;
+    int maxSuppressedNotifications;
+    int numConsecutiveSuppressed = 0;
+    bool stepNotification = true;
+    CarlaPoseStore::Handle poseStoreHandle = -1;
+    long numSuppressedNotifications = 0;
+    inet::Coord lastNotifiedPosition;
+    inet::Quaternion lastNotifiedOrientation;
+
+    ExtrapolationMode extrapolationMode = EXTRAPOLATION_NONE;
+    simtime_t maxExtrapolationTime;
+    simtime_t lastUpdate;
+
     string carlaActorType;
 
     bool preInitialized = false; // This field is set during dynamic module creation.
 
 protected:
     cValueMap* carlaActorConfiguration;
+    const CarlaActorConfiguration* sharedCarlaActorConfiguration = nullptr;
+    CarlanetManager* carlanetManager = nullptr;
+
+    /**
+     * Attributes of the actor streamed by CARLA with each frame (e.g. speed, steering), for subclasses
+     * that need more than the pose: subscribe in initialize() (stage INITSTAGE_LOCAL, after this class)
+     * and read the last value at any time (defaultValue until the first frame that contains it).
+     */
+    CarlaActorAttributes::AttributeId subscribeCarlaAttribute(const std::string& attribute);
+    double getCarlaAttribute(CarlaActorAttributes::AttributeId attribute, double defaultValue = 0) const;
 };
 
 #endif
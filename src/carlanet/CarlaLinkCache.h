@@ -0,0 +1,69 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+#ifndef CARLALINKCACHE_H_
+#define CARLALINKCACHE_H_
+
+#include <functional>
+#include <unordered_map>
+
+#include "inet/common/geometry/common/Coord.h"
+
+/*
+ * Cache of values computed for a link (e.g. losses), keyed by the positions of its ends and the frequency.
+ * Since the CARLA nodes move only at the steps, the same links are evaluated many times between two
+ * steps; the owners clear the cache at each step (carlaStepCompleted signal) to bound its size.
+ * Keys are the exact positions, so a cached value is never used for a different geometry
+ * (e.g. between the steps, with the pose extrapolation of CarlaInetMobility).
+ */
+template <typename T>
+class CarlaLinkCache
+{
+public:
+    // Returns the cached value, or nullptr
+    const T* find(const inet::Coord& a, const inet::Coord& b, double frequency) const {
+        auto it = values.find({a, b, frequency});
+        if (it == values.end()) {
+            numMisses++;
+            return nullptr;
+        }
+        numHits++;
+        return &it->second;
+    }
+
+    void insert(const inet::Coord& a, const inet::Coord& b, double frequency, const T& value) {
+        values[{a, b, frequency}] = value;
+    }
+
+    void clear() { values.clear(); }
+
+    size_t size() const { return values.size(); }
+    long getNumHits() const { return numHits; }
+    long getNumMisses() const { return numMisses; }
+
+private:
+    struct Key {
+        inet::Coord a, b;
+        double frequency;
+        bool operator==(const Key& other) const {
+            return a.x == other.a.x && a.y == other.a.y && a.z == other.a.z &&
+                   b.x == other.b.x && b.y == other.b.y && b.z == other.b.z && frequency == other.frequency;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            std::hash<double> hash;
+            size_t seed = 0;
+            for (double value : { key.a.x, key.a.y, key.a.z, key.b.x, key.b.y, key.b.z, key.frequency })
+                seed ^= hash(value) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+            return seed;
+        }
+    };
+
+    std::unordered_map<Key, T, KeyHash> values;
+    mutable long numHits = 0;
+    mutable long numMisses = 0;
+};
+
+#endif
@@ -0,0 +1,360 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+/*
+ * Typed channel for the generic messages exchanged by the applications with pycarlanet.
+ *
+ * The messages declared with CARLA_DEFINE_MESSAGE are written straight into the send buffer, and the
+ * responses are read from the receive buffer with the SAX parser of nlohmann json, so no json tree is
+ * built in between (the json API sendToAndGetFromCarla<S,T> builds four for each exchange).
+ * The wire text is the same as json::dump() on the json path, which the macro also defines (to_json/from_json):
+ * the keys are sorted, and numbers and strings are formatted as nlohmann json does. So the declared types can
+ * be used with both.
+ *
+ * There is no registry of the types nor dispatch by type id: every exchange is a synchronous request/response,
+ * so the type of the response is known at the call site (the T of sendToAndGetFromCarla<S,T>), and the
+ * GENERIC_RESPONSE carries no type id to dispatch on.
+ *
+ * Only flat messages are supported: the fields must be strings, booleans or numbers.
+ * Messages with structured fields keep using NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE and the json path.
+ */
+
+#ifndef CARLAMESSAGECHANNEL_H_
+#define CARLAMESSAGECHANNEL_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "../lib/json.hpp"
+
+
+/*
+ * Appends JSON text to a buffer, formatted as json::dump() (without indentation) formats it.
+ */
+class CarlaWireWriter
+{
+public:
+    CarlaWireWriter(std::string& buffer) : buffer(buffer) {}
+
+    void beginObject() { separate(); buffer += '{'; first = true; }
+    void endObject() { buffer += '}'; first = false; }
+
+    void key(const char* name) {
+        separate();
+        writeString(name, strlen(name));
+        buffer += ':';
+        first = true;  // the value follows without a comma
+    }
+
+    void write(const char* name, const std::string& value) { key(name); separate(); writeString(value.data(), value.size()); }
+    void write(const char* name, const char* value) { key(name); separate(); writeString(value, strlen(value)); }
+    void write(const char* name, bool value) { key(name); separate(); buffer += value ? "true" : "false"; }
+
+    template <typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+    void write(const char* name, T value) { key(name); separate(); buffer += std::to_string(value); }
+
+    void write(const char* name, double value) {
+        key(name);
+        separate();
+        if (!std::isfinite(value)) {
+            buffer += "null";  // as nlohmann json
+            return;
+        }
+        // Shortest text that reads back the same value, with the algorithm of json::dump()
+        char text[64];
+        char* end = nlohmann::detail::to_chars(text, text + sizeof(text), value);
+        buffer.append(text, end - text);
+    }
+
+private:
+    void separate() {
+        if (!first)
+            buffer += ',';
+        first = false;
+    }
+
+    void writeString(const char* value, size_t length) {
+        buffer += '"';
+        for (const char* c = value; c != value + length; c++) {
+            switch (*c) {
+            case '"': buffer += "\\\""; break;
+            case '\\': buffer += "\\\\"; break;
+            case '\b': buffer += "\\b"; break;
+            case '\f': buffer += "\\f"; break;
+            case '\n': buffer += "\\n"; break;
+            case '\r': buffer += "\\r"; break;
+            case '\t': buffer += "\\t"; break;
+            default:
+                if ((unsigned char) *c < 0x20) {
+                    char escape[8];
+                    snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char) *c);
+                    buffer += escape;
+                }
+                else
+                    buffer += *c;
+            }
+        }
+        buffer += '"';
+    }
+
+    std::string& buffer;
+    bool first = true;
+};
+
+
+/*
+ * Scalar value read from the wire, passed to the fields of a message.
+ */
+struct CarlaWireValue
+{
+    enum Kind { NULL_VALUE, BOOL, INTEGER, FLOAT, STRING } kind = NULL_VALUE;
+    bool boolValue = false;
+    int64_t integerValue = 0;
+    double floatValue = 0;
+    const std::string* stringValue = nullptr;
+};
+
+inline void carlaWireAssign(std::string& field, const CarlaWireValue& value) {
+    if (value.kind != CarlaWireValue::STRING)
+        throw std::runtime_error("Typed CARLA message: a string was expected");
+    field = *value.stringValue;
+}
+
+inline void carlaWireAssign(bool& field, const CarlaWireValue& value) {
+    if (value.kind != CarlaWireValue::BOOL)
+        throw std::runtime_error("Typed CARLA message: a boolean was expected");
+    field = value.boolValue;
+}
+
+template <typename T, typename std::enable_if<std::is_arithmetic<T>::value && !std::is_same<T, bool>::value, int>::type = 0>
+inline void carlaWireAssign(T& field, const CarlaWireValue& value) {
+    if (value.kind == CarlaWireValue::INTEGER)
+        field = (T) value.integerValue;
+    else if (value.kind == CarlaWireValue::FLOAT)
+        field = (T) value.floatValue;
+    else
+        throw std::runtime_error("Typed CARLA message: a number was expected");
+}
+
+
+/*
+ * Compile-time description of a message type, specialised by CARLA_DEFINE_MESSAGE:
+ * the direct serialization of its fields.
+ */
+template <typename T>
+struct CarlaMessageTraits
+{
+    static const bool defined = false;
+};
+
+// Indices of the fields in the order of their names, as the keys of a json object
+inline std::vector<int> carlaSortFields(const char* (*getFieldName)(int), int numFields) {
+    std::vector<int> order(numFields);
+    for (int i = 0; i < numFields; i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [getFieldName] (int a, int b) { return strcmp(getFieldName(a), getFieldName(b)) < 0; });
+    return order;
+}
+
+#define CARLA_WIRE_WRITE_FIELD(f) if (index == field++) { writer.write(#f, message.f); return; }
+#define CARLA_WIRE_READ_FIELD(f) if (key == #f) { carlaWireAssign(message.f, value); return index; } index++;
+#define CARLA_WIRE_FIELD_NAME(f) #f,
+#define CARLA_WIRE_COUNT_FIELD(f) + 1
+
+/**
+ * Declares a flat message type, e.g.
+ *     CARLA_DEFINE_MESSAGE(light_update, msg_type, light_curr_state)
+ * It must be used at global scope, in place of NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE.
+ * As with that macro, all the fields are required when the message is read.
+ */
+#define CARLA_DEFINE_MESSAGE(Type, ...) \
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Type, __VA_ARGS__) \
+    template <> \
+    struct CarlaMessageTraits<Type> { \
+        static const bool defined = true; \
+        static const int numFields = 0 NLOHMANN_JSON_EXPAND(NLOHMANN_JSON_PASTE(CARLA_WIRE_COUNT_FIELD, __VA_ARGS__)); \
+        /* Writes the fields sorted by name, as json::dump() */ \
+        static void write(CarlaWireWriter& writer, const Type& message) { \
+            static const std::vector<int> order = carlaSortFields(&getFieldName, numFields); \
+            for (int index : order) \
+                writeField(writer, message, index); \
+        } \
+        static void writeField(CarlaWireWriter& writer, const Type& message, int index) { \
+            int field = 0; \
+            NLOHMANN_JSON_EXPAND(NLOHMANN_JSON_PASTE(CARLA_WIRE_WRITE_FIELD, __VA_ARGS__)) \
+        } \
+        /* Assigns the field and returns its index, -1 if the message has no field with that name */ \
+        static int readField(const std::string& key, const CarlaWireValue& value, Type& message) { \
+            int index = 0; \
+            NLOHMANN_JSON_EXPAND(NLOHMANN_JSON_PASTE(CARLA_WIRE_READ_FIELD, __VA_ARGS__)) \
+            return -1; \
+        } \
+        static const char* getFieldName(int index) { \
+            static const char* const names[] = { NLOHMANN_JSON_EXPAND(NLOHMANN_JSON_PASTE(CARLA_WIRE_FIELD_NAME, __VA_ARGS__)) }; \
+            return names[index]; \
+        } \
+    };
+
+
+/* ***********************************
+ * Envelopes of the generic messages
+ * ********************************** */
+
+// Writes a GENERIC_MESSAGE carrying the message into the buffer (replacing its content)
+template <typename S>
+void carlaWriteGenericMessage(std::string& buffer, double timestamp, const S& message) {
+    buffer.clear();
+    CarlaWireWriter writer(buffer);
+    writer.beginObject();
+    writer.write("message_type", "GENERIC_MESSAGE");
+    writer.write("timestamp", timestamp);
+    writer.key("user_defined");
+    writer.beginObject();
+    CarlaMessageTraits<S>::write(writer, message);
+    writer.endObject();
+    writer.endObject();
+}
+
+/*
+ * SAX handler reading a GENERIC_RESPONSE: the scalar fields of user_defined go to the message,
+ * the other ones (e.g. added by newer versions of pycarlanet) are skipped.
+ * It is as strict as the json path: message_type, user_defined (an object), simulation_status and
+ * every field of the message are required, and null or structured values of the fields are errors.
+ */
+template <typename T>
+class CarlaGenericResponseReader
+{
+public:
+    typedef nlohmann::json::number_integer_t number_integer_t;
+    typedef nlohmann::json::number_unsigned_t number_unsigned_t;
+    typedef nlohmann::json::number_float_t number_float_t;
+    typedef nlohmann::json::string_t string_t;
+    typedef nlohmann::json::binary_t binary_t;
+
+    static_assert(CarlaMessageTraits<T>::numFields <= 64, "Typed CARLA messages have at most 64 fields");
+
+    CarlaGenericResponseReader(T& message) : message(message) {}
+
+    // Throws if a required field was missing
+    void checkComplete() const {
+        if (!hasMessageType)
+            throw std::runtime_error("Malformed CARLA response: message_type is missing");
+        if (!hasUserDefined)
+            throw std::runtime_error("Malformed CARLA response: user_defined is missing");
+        if (!hasSimulationStatus)
+            throw std::runtime_error("Malformed CARLA response: simulation_status is missing");
+        for (int i = 0; i < CarlaMessageTraits<T>::numFields; i++)
+            if (!(seenFields & (uint64_t(1) << i)))
+                throw std::runtime_error(std::string("Typed CARLA message: field '") + CarlaMessageTraits<T>::getFieldName(i) + "' is missing");
+    }
+
+    int getSimulationStatus() const { return simulationStatus; }
+
+    bool null() { return scalar(CarlaWireValue()); }
+    bool boolean(bool value) {
+        CarlaWireValue v;
+        v.kind = CarlaWireValue::BOOL;
+        v.boolValue = value;
+        return scalar(v);
+    }
+    bool number_integer(number_integer_t value) {
+        CarlaWireValue v;
+        v.kind = CarlaWireValue::INTEGER;
+        v.integerValue = value;
+        return scalar(v);
+    }
+    bool number_unsigned(number_unsigned_t value) { return number_integer((number_integer_t) value); }
+    bool number_float(number_float_t value, const string_t&) {
+        CarlaWireValue v;
+        v.kind = CarlaWireValue::FLOAT;
+        v.floatValue = value;
+        return scalar(v);
+    }
+    bool string(string_t& value) {
+        CarlaWireValue v;
+        v.kind = CarlaWireValue::STRING;
+        v.stringValue = &value;
+        return scalar(v);
+    }
+    bool binary(binary_t&) { return scalar(CarlaWireValue()); }
+    bool start_object(std::size_t) { return structured(true); }
+    bool end_object() { depth--; if (depth < 2) inUserDefined = false; return true; }
+    bool start_array(std::size_t) { return structured(false); }
+    bool end_array() { depth--; return true; }
+    bool key(string_t& name) {
+        if (depth == 1)
+            inUserDefined = name == "user_defined";
+        currentKey.swap(name);
+        return true;
+    }
+    bool parse_error(std::size_t, const std::string&, const nlohmann::json::exception& e) {
+        throw std::runtime_error(std::string("Malformed CARLA response: ") + e.what());
+    }
+
+private:
+    bool scalar(const CarlaWireValue& value) {
+        if (depth == 1) {
+            if (currentKey == "simulation_status") {
+                if (value.kind == CarlaWireValue::INTEGER)
+                    simulationStatus = (int) value.integerValue;
+                else if (value.kind == CarlaWireValue::FLOAT)
+                    simulationStatus = (int) value.floatValue;
+                else
+                    throw std::runtime_error("Malformed CARLA response: simulation_status is not a number");
+                hasSimulationStatus = true;
+            }
+            else if (currentKey == "message_type")
+                hasMessageType = true;
+            else if (inUserDefined)
+                throw std::runtime_error("Malformed CARLA response: user_defined is not an object");
+        }
+        else if (depth == 2 && inUserDefined)
+            read(value);
+        return true;
+    }
+
+    bool structured(bool isObject) {
+        if (depth == 1 && inUserDefined && !isObject)
+            throw std::runtime_error("Malformed CARLA response: user_defined is not an object");
+        if (depth == 1 && inUserDefined)
+            hasUserDefined = true;
+        else if (depth == 2 && inUserDefined)
+            read(CarlaWireValue());  // the fields of the message are scalars: an error if it is one of them
+        depth++;
+        return true;
+    }
+
+    void read(const CarlaWireValue& value) {
+        int index = CarlaMessageTraits<T>::readField(currentKey, value, message);
+        if (index >= 0)
+            seenFields |= uint64_t(1) << index;
+    }
+
+    T& message;
+    int depth = 0;
+    bool inUserDefined = false;
+    std::string currentKey;
+    bool hasMessageType = false;
+    bool hasUserDefined = false;
+    bool hasSimulationStatus = false;
+    uint64_t seenFields = 0;
+    int simulationStatus = 0;
+};
+
+// Reads a GENERIC_RESPONSE into the message and returns its simulation status
+template <typename T>
+int carlaReadGenericResponse(const char* data, size_t size, T& message) {
+    CarlaGenericResponseReader<T> reader(message);
+    nlohmann::json::sax_parse(data, data + size, &reader);
+    reader.checkComplete();
+    return reader.getSimulationStatus();
+}
+
+#endif
@@ -0,0 +1,115 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+
+#include "CarlaNeighborCache.h"
+
+#include "CarlanetManager.h"
+#include "utils.h"
+
+Define_Module(CarlaNeighborCache);
+
+using namespace inet;
+
+static simsignal_t carlaStepCompletedSignal = cComponent::registerSignal("carlaStepCompleted");
+
+
+void CarlaNeighborCache::initialize(int stage){
+    cSimpleModule::initialize(stage);
+    if (stage == INITSTAGE_LOCAL){
+        radioMedium = check_and_cast<RadioMedium *>(getParentModule());
+        range = par("range");
+        rangeMargin = par("rangeMargin");
+        grid.setCellSize(range + rangeMargin);
+        cModule* root = getSimulation()->getSystemModule();
+        auto carlanetManager = dynamic_cast<CarlanetManager*>(root->getSubmodule(par("carlanetManagerModule").stringValue()));
+        if (carlanetManager == nullptr)
+            carlanetManager = getFirstSubmoduleOfType<CarlanetManager>(root);
+        if (carlanetManager == nullptr)
+            throw cRuntimeError("CarlanetManager not found in the network");
+        // The cache is invalidated only by the bulk notification
+        if (!carlanetManager->isStepCompletedSignalEmitted())
+            throw cRuntimeError("CarlaNeighborCache requires stepNotification \"bulk\" or \"both\" in %s", carlanetManager->getFullPath().c_str());
+        root->subscribe(carlaStepCompletedSignal, this);
+        WATCH(numRebuilds);
+        WATCH(numReceiverEvaluations);
+    }
+}
+
+void CarlaNeighborCache::finish(){
+    recordScalar("numRebuilds", numRebuilds);
+    recordScalar("numTransmissions", numTransmissions);
+    recordScalar("numReceiverEvaluations", numReceiverEvaluations);
+}
+
+void CarlaNeighborCache::receiveSignal(cComponent *source, simsignal_t signalID, cObject *obj, cObject *details){
+    if (signalID == carlaStepCompletedSignal){
+        auto notification = check_and_cast<CarlaStepNotification *>(obj);
+        // Removed nodes are handled by removeRadio()
+        if (!notification->changedModules.empty())
+            stale = true;
+    }
+}
+
+
+void CarlaNeighborCache::addRadio(const IRadio *radio){
+    Enter_Method("addRadio");
+    radioIndices[radio] = radios.size();
+    radios.push_back(radio);
+    stale = true;
+}
+
+void CarlaNeighborCache::removeRadio(const IRadio *radio){
+    Enter_Method("removeRadio");
+    auto it = radioIndices.find(radio);
+    if (it == radioIndices.end())
+        return;
+    size_t index = it->second;
+    radios[index] = radios.back();
+    radioIndices[radios[index]] = index;
+    radios.pop_back();
+    radioIndices.erase(it);
+    stale = true;
+}
+
+
+void CarlaNeighborCache::rebuild() const{
+    grid.clear();
+    for (size_t i = 0; i < radios.size(); i++)
+        grid.update(i, radios[i]->getAntenna()->getMobility()->getCurrentPosition());
+
+    double neighborRange = range + rangeMargin;
+    std::vector<CarlaSpatialIndex::Handle> inRange;
+    neighbors.resize(radios.size());
+    for (size_t i = 0; i < radios.size(); i++){
+        inRange.clear();
+        grid.getInRange(grid.getPosition(i), neighborRange, inRange);
+        auto& list = neighbors[i];
+        list.clear();
+        for (auto j : inRange)
+            if ((size_t) j != i)
+                list.push_back(radios[j]);
+    }
+    stale = false;
+    numRebuilds++;
+}
+
+void CarlaNeighborCache::sendToNeighbors(IRadio *transmitter, const IWirelessSignal *signal, double range) const{
+    Enter_Method("sendToNeighbors");
+    if (range > this->range)
+        throw cRuntimeError("The transmission range (%gm) exceeds the range of the neighbour cache (%gm)", range, this->range);
+    if (stale)
+        rebuild();
+    auto it = radioIndices.find(transmitter);
+    if (it == radioIndices.end())
+        throw cRuntimeError("Transmitting radio not found in the neighbour cache");
+    numTransmissions++;
+    for (auto receiver : neighbors[it->second]){
+        radioMedium->sendToRadio(transmitter, receiver, signal);
+        numReceiverEvaluations++;
+    }
+}
+
+std::ostream& CarlaNeighborCache::printToStream(std::ostream& stream, int level, int evFlags) const{
+    return stream << "CarlaNeighborCache, range = " << range << "m, rangeMargin = " << rangeMargin << "m";
+}
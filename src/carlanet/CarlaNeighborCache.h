@@ -0,0 +1,55 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+#ifndef CARLANEIGHBORCACHE_H_
+#define CARLANEIGHBORCACHE_H_
+
+#include <unordered_map>
+#include <vector>
+
+#include <omnetpp.h>
+#include "inet/physicallayer/wireless/common/contract/packetlevel/INeighborCache.h"
+#include "inet/physicallayer/wireless/common/medium/RadioMedium.h"
+#include "CarlaSpatialIndex.h"
+
+using namespace omnetpp;
+using namespace inet::physicallayer;
+
+/*
+ * Neighbour cache of the INET radio medium rebuilt from the carlaStepCompleted signal of the
+ * CarlanetManager, instead of at a fixed period or at each mobility change (see the NED file).
+ */
+class CarlaNeighborCache : public cSimpleModule, public INeighborCache, public cListener
+{
+public:
+    virtual void addRadio(const IRadio *radio) override;
+    virtual void removeRadio(const IRadio *radio) override;
+    virtual void sendToNeighbors(IRadio *transmitter, const IWirelessSignal *signal, double range) const override;
+    virtual std::ostream& printToStream(std::ostream& stream, int level, int evFlags = 0) const override;
+
+protected:
+    virtual int numInitStages() const override { return inet::NUM_INIT_STAGES; }
+    virtual void initialize(int stage) override;
+    virtual void handleMessage(cMessage *msg) override { throw cRuntimeError("This module does not handle messages"); }
+    virtual void finish() override;
+    virtual void receiveSignal(cComponent *source, simsignal_t signalID, cObject *obj, cObject *details) override;
+
+    // Rebuilds the neighbour lists of all the radios from their current positions
+    void rebuild() const;
+
+    RadioMedium *radioMedium = nullptr;
+    double range;
+    double rangeMargin;
+    std::vector<const IRadio*> radios;
+    std::unordered_map<const IRadio*, size_t> radioIndices;  // index in radios
+
+    // The cache is filled lazily, by the const sendToNeighbors()
+    mutable bool stale = true;
+    mutable CarlaSpatialIndex grid;
+    mutable std::vector<std::vector<const IRadio*>> neighbors;  // indexed as radios
+    mutable long numRebuilds = 0;
+    mutable long numTransmissions = 0;
+    mutable long numReceiverEvaluations = 0;
+};
+
+#endif
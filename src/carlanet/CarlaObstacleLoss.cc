@@ -0,0 +1,94 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+
+#include "CarlaObstacleLoss.h"
+
+#include "CarlanetManager.h"
+#include "utils.h"
+
+Define_Module(CarlaObstacleLoss);
+
+using namespace inet;
+
+static simsignal_t carlaStepCompletedSignal = cComponent::registerSignal("carlaStepCompleted");
+
+
+void CarlaObstacleLoss::initialize(int stage){
+    cModule::initialize(stage);
+    if (stage == INITSTAGE_LOCAL){
+        vehicleLoss = par("vehicleLoss");
+        vehicleLossPerMeter = par("vehicleLossPerMeter");
+        staticObjectLoss = par("staticObjectLoss");
+        staticObjectLossPerMeter = par("staticObjectLossPerMeter");
+        maxLoss = par("maxLoss");
+        cacheLosses = par("cacheLosses");
+        cModule* root = getSimulation()->getSystemModule();
+        carlanetManager = dynamic_cast<CarlanetManager*>(root->getSubmodule(par("carlanetManagerModule").stringValue()));
+        if (carlanetManager == nullptr)
+            carlanetManager = getFirstSubmoduleOfType<CarlanetManager>(root);
+        if (carlanetManager == nullptr)
+            throw cRuntimeError("CarlanetManager not found in the network");
+        if (cacheLosses){
+            // The cache is cleared only by the bulk notification, otherwise it would grow forever
+            if (!carlanetManager->isStepCompletedSignalEmitted())
+                throw cRuntimeError("cacheLosses requires stepNotification \"bulk\" or \"both\" in %s", carlanetManager->getFullPath().c_str());
+            root->subscribe(carlaStepCompletedSignal, this);
+        }
+        WATCH(numIntersections);
+    }
+}
+
+void CarlaObstacleLoss::finish(){
+    recordScalar("numQueries", numQueries);
+    recordScalar("numCandidateTests", numCandidateTests);
+    recordScalar("numIntersections", numIntersections);
+    if (cacheLosses){
+        recordScalar("numCacheHits", lossCache.getNumHits());
+        recordScalar("numCacheMisses", lossCache.getNumMisses());
+    }
+}
+
+void CarlaObstacleLoss::receiveSignal(cComponent *source, simsignal_t signalID, cObject *obj, cObject *details){
+    if (signalID == carlaStepCompletedSignal)
+        lossCache.clear();
+}
+
+double CarlaObstacleLoss::computeObstacleLoss(Hz frequency, const Coord& transmissionPosition, const Coord& receptionPosition) const{
+    if (!cacheLosses)
+        return computeLoss(transmissionPosition, receptionPosition);
+    // The loss does not depend on the frequency
+    if (auto cached = lossCache.find(transmissionPosition, receptionPosition, 0))
+        return *cached;
+    double loss = computeLoss(transmissionPosition, receptionPosition);
+    lossCache.insert(transmissionPosition, receptionPosition, 0, loss);
+    return loss;
+}
+
+double CarlaObstacleLoss::computeLoss(const Coord& transmissionPosition, const Coord& receptionPosition) const{
+    auto vehicles = carlanetManager->getVehicleObstacles();
+    auto staticGeometry = carlanetManager->getStaticGeometry();
+    if (vehicles == nullptr && staticGeometry == nullptr)
+        throw cRuntimeError("No obstacles in the CarlanetManager (see its vehicleObstacles and importStaticGeometry parameters)");
+    numQueries++;
+    double loss = 0;
+    if (vehicles != nullptr){
+        vehicleIntersections.clear();
+        numCandidateTests += vehicles->getIntersections(transmissionPosition, receptionPosition, vehicleIntersections);
+        numIntersections += vehicleIntersections.size();
+        for (auto const &intersection : vehicleIntersections)
+            loss += vehicleLoss + vehicleLossPerMeter * intersection.length;
+    }
+    if (staticGeometry != nullptr){
+        staticIntersections.clear();
+        numCandidateTests += staticGeometry->getIntersections(transmissionPosition, receptionPosition, staticIntersections);
+        numIntersections += staticIntersections.size();
+        for (auto const &intersection : staticIntersections)
+            loss += staticObjectLoss + staticObjectLossPerMeter * intersection.length;
+    }
+    return loss > 0 ? dB2fraction(-std::min(loss, maxLoss)) : 1;
+}
+
+std::ostream& CarlaObstacleLoss::printToStream(std::ostream& stream, int level, int evFlags) const{
+    return stream << "CarlaObstacleLoss, vehicleLoss = " << vehicleLoss << "dB, staticObjectLossPerMeter = " << staticObjectLossPerMeter << "dB";
+}
@@ -0,0 +1,53 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+#ifndef CARLAOBSTACLELOSS_H_
+#define CARLAOBSTACLELOSS_H_
+
+#include <vector>
+
+#include <omnetpp.h>
+#include "inet/physicallayer/wireless/common/contract/packetlevel/IObstacleLoss.h"
+#include "CarlaVehicleObstacles.h"
+#include "CarlaStaticGeometry.h"
+#include "CarlaLinkCache.h"
+
+using namespace omnetpp;
+using namespace inet::physicallayer;
+
+class CarlanetManager;
+
+/*
+ * Obstacle loss of the vehicles and of the static geometry of the CARLA world (see the NED file).
+ */
+class CarlaObstacleLoss : public cModule, public IObstacleLoss, public cListener
+{
+public:
+    virtual double computeObstacleLoss(inet::Hz frequency, const inet::Coord& transmissionPosition, const inet::Coord& receptionPosition) const override;
+    virtual std::ostream& printToStream(std::ostream& stream, int level, int evFlags = 0) const override;
+
+protected:
+    virtual int numInitStages() const override { return inet::NUM_INIT_STAGES; }
+    virtual void initialize(int stage) override;
+    virtual void finish() override;
+    virtual void receiveSignal(cComponent *source, simsignal_t signalID, cObject *obj, cObject *details) override;
+    double computeLoss(const inet::Coord& transmissionPosition, const inet::Coord& receptionPosition) const;
+
+    CarlanetManager *carlanetManager = nullptr;
+    double vehicleLoss;  // dB
+    double vehicleLossPerMeter;  // dB
+    double staticObjectLoss;  // dB
+    double staticObjectLossPerMeter;  // dB
+    double maxLoss;  // dB
+
+    mutable std::vector<CarlaVehicleObstacles::Intersection> vehicleIntersections;
+    mutable std::vector<CarlaStaticGeometry::Intersection> staticIntersections;
+    mutable long numQueries = 0;
+    mutable long numCandidateTests = 0;
+    mutable long numIntersections = 0;
+
+    bool cacheLosses;
+    mutable CarlaLinkCache<double> lossCache;
+};
+
+#endif
@@ -0,0 +1,217 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+
+#include "CarlaPoseConversion.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace inet;
+
+
+/* ***********************************
+ * Vector operations, one set for each instruction set
+ * ********************************** */
+namespace {
+
+struct ScalarOps {
+    typedef double V;
+    typedef bool M;
+    static const size_t width = 1;
+    static V load(const double* p) { return *p; }
+    static void store(double* p, V v) { *p = v; }
+    static V set1(double d) { return d; }
+    static V add(V a, V b) { return a + b; }
+    static V sub(V a, V b) { return a - b; }
+    static V mul(V a, V b) { return a * b; }
+    static V abs(V a) { return std::fabs(a); }
+    static M lt(V a, V b) { return a < b; }
+    static M gt(V a, V b) { return a > b; }
+    static M eq(V a, V b) { return a == b; }
+    static V select(M m, V a, V b) { return m ? a : b; }
+};
+
+#if defined(__AVX2__)
+#define CARLA_POSE_KERNEL "avx2"
+struct SimdOps {
+    typedef __m256d V;
+    typedef __m256d M;
+    static const size_t width = 4;
+    static V load(const double* p) { return _mm256_loadu_pd(p); }
+    static void store(double* p, V v) { _mm256_storeu_pd(p, v); }
+    static V set1(double d) { return _mm256_set1_pd(d); }
+    static V add(V a, V b) { return _mm256_add_pd(a, b); }
+    static V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+    static V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+    static V abs(V a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a); }
+    static M lt(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+    static M gt(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+    static M eq(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_EQ_OQ); }
+    static V select(M m, V a, V b) { return _mm256_blendv_pd(b, a, m); }
+};
+#elif defined(__SSE2__)
+#define CARLA_POSE_KERNEL "sse2"
+struct SimdOps {
+    typedef __m128d V;
+    typedef __m128d M;
+    static const size_t width = 2;
+    static V load(const double* p) { return _mm_loadu_pd(p); }
+    static void store(double* p, V v) { _mm_storeu_pd(p, v); }
+    static V set1(double d) { return _mm_set1_pd(d); }
+    static V add(V a, V b) { return _mm_add_pd(a, b); }
+    static V sub(V a, V b) { return _mm_sub_pd(a, b); }
+    static V mul(V a, V b) { return _mm_mul_pd(a, b); }
+    static V abs(V a) { return _mm_andnot_pd(_mm_set1_pd(-0.0), a); }
+    static M lt(V a, V b) { return _mm_cmplt_pd(a, b); }
+    static M gt(V a, V b) { return _mm_cmpgt_pd(a, b); }
+    static M eq(V a, V b) { return _mm_cmpeq_pd(a, b); }
+    static V select(M m, V a, V b) { return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b)); }
+};
+#else
+#define CARLA_POSE_KERNEL "scalar"
+#endif
+
+
+// floor() of non-negative values below 2^52, with additions only (SSE2 has no rounding instruction)
+template <class O>
+inline typename O::V floorNonNegative(typename O::V x){
+    const typename O::V magic = O::set1(4503599627370496.0);  // 2^52
+    typename O::V t = O::sub(O::add(x, magic), magic);  // rounded to nearest
+    return O::select(O::gt(t, x), O::sub(t, O::set1(1)), t);
+}
+
+/*
+ * Sine and cosine of all the lanes, with the range reduction and the polynomials of the Cephes library
+ * (accurate to about one ulp for the magnitudes of angles).
+ */
+template <class O>
+inline void sincos(typename O::V a, typename O::V& sinA, typename O::V& cosA){
+    typedef typename O::V V;
+    const V one = O::set1(1);
+    const V minusOne = O::set1(-1);
+
+    // Octant of |a|, rounded up to even
+    V x = O::abs(a);
+    V y = floorNonNegative<O>(O::mul(x, O::set1(1.27323954473516268615)));  // 4/pi
+    V half = floorNonNegative<O>(O::mul(y, O::set1(0.5)));
+    y = O::add(y, O::sub(y, O::add(half, half)));
+    V j = O::sub(y, O::mul(O::set1(8), floorNonNegative<O>(O::mul(y, O::set1(0.125)))));
+
+    // Extended precision modular arithmetic: z = x - y * pi/4
+    V z = O::sub(x, O::mul(y, O::set1(7.85398125648498535156E-1)));
+    z = O::sub(z, O::mul(y, O::set1(3.77489470793079817668E-8)));
+    z = O::sub(z, O::mul(y, O::set1(2.69515142907905952645E-15)));
+    V zz = O::mul(z, z);
+
+    V ps = O::set1(1.58962301576546568060E-10);
+    ps = O::add(O::mul(ps, zz), O::set1(-2.50507477628578072866E-8));
+    ps = O::add(O::mul(ps, zz), O::set1(2.75573136213857245213E-6));
+    ps = O::add(O::mul(ps, zz), O::set1(-1.98412698295895385996E-4));
+    ps = O::add(O::mul(ps, zz), O::set1(8.33333333332211858878E-3));
+    ps = O::add(O::mul(ps, zz), O::set1(-1.66666666666666307295E-1));
+    ps = O::add(z, O::mul(O::mul(z, zz), ps));
+
+    V pc = O::set1(-1.13585365213876817300E-11);
+    pc = O::add(O::mul(pc, zz), O::set1(2.08757008419747316778E-9));
+    pc = O::add(O::mul(pc, zz), O::set1(-2.75573141792967388112E-7));
+    pc = O::add(O::mul(pc, zz), O::set1(2.48015872888517045348E-5));
+    pc = O::add(O::mul(pc, zz), O::set1(-1.38888888888730564116E-3));
+    pc = O::add(O::mul(pc, zz), O::set1(4.16666666666665929218E-2));
+    pc = O::add(O::sub(one, O::mul(zz, O::set1(0.5))), O::mul(O::mul(zz, zz), pc));
+
+    // Octants 4-7 are octants 0-3 with opposite sign; in octants 2-3 sine and cosine swap
+    auto upper = O::gt(j, O::set1(3));
+    V upperSign = O::select(upper, minusOne, one);
+    auto swap = O::eq(O::select(upper, O::sub(j, O::set1(4)), j), O::set1(2));
+    V sinSign = O::mul(upperSign, O::select(O::lt(a, O::set1(0)), minusOne, one));
+    V cosSign = O::mul(upperSign, O::select(swap, minusOne, one));
+    sinA = O::mul(sinSign, O::select(swap, pc, ps));
+    cosA = O::mul(cosSign, O::select(swap, ps, pc));
+}
+
+// Converts the angles from index begin while a whole vector fits before end; returns the first index left
+template <class O>
+size_t eulerToQuaternionKernel(size_t begin, size_t end, const double* alpha, const double* beta, const double* gamma,
+                               double* s, double* x, double* y, double* z){
+    typedef typename O::V V;
+    const V half = O::set1(0.5);
+    size_t i = begin;
+    for (; i + O::width <= end; i += O::width){
+        V sy, cy, sp, cp, sr, cr;
+        sincos<O>(O::mul(O::load(alpha + i), half), sy, cy);
+        sincos<O>(O::mul(O::load(beta + i), half), sp, cp);
+        sincos<O>(O::mul(O::load(gamma + i), half), sr, cr);
+        V crcp = O::mul(cr, cp);
+        V srsp = O::mul(sr, sp);
+        V srcp = O::mul(sr, cp);
+        V crsp = O::mul(cr, sp);
+        O::store(s + i, O::add(O::mul(crcp, cy), O::mul(srsp, sy)));
+        O::store(x + i, O::sub(O::mul(srcp, cy), O::mul(crsp, sy)));
+        O::store(y + i, O::add(O::mul(crsp, cy), O::mul(srcp, sy)));
+        O::store(z + i, O::sub(O::mul(crcp, sy), O::mul(srsp, cy)));
+    }
+    return i;
+}
+
+}
+
+
+/* ***********************************
+ * Batch conversion
+ * ********************************** */
+void CarlaPoseConversion::eulerToQuaternion(size_t n, const double* alpha, const double* beta, const double* gamma,
+                                            double* s, double* x, double* y, double* z){
+    size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+    i = eulerToQuaternionKernel<SimdOps>(i, n, alpha, beta, gamma, s, x, y, z);
+#endif
+    // The remainder uses the same approximation, one lane at a time
+    eulerToQuaternionKernel<ScalarOps>(i, n, alpha, beta, gamma, s, x, y, z);
+}
+
+const char* CarlaPoseConversion::getKernelName(){
+    return CARLA_POSE_KERNEL;
+}
+
+void CarlaPoseConversion::convert(const std::list<carla_api_base::actor_position>& actors){
+    size_t n = actors.size();
+    for (auto array : { &alpha, &beta, &gamma, &s, &x, &y, &z })
+        array->resize(n);
+    positions.resize(n);
+    velocities.resize(n);
+    orientations.resize(n);
+
+    size_t i = 0;
+    for (auto const &actor : actors){
+        positions[i] = Coord(actor.position[0], actor.position[1], actor.position[2]);
+        velocities[i] = Coord(actor.velocity[0], actor.velocity[1], actor.velocity[2]);
+        alpha[i] = actor.rotation[0];
+        beta[i] = actor.rotation[1];
+        gamma[i] = actor.rotation[2];
+        i++;
+    }
+
+    eulerToQuaternion(n, alpha.data(), beta.data(), gamma.data(), s.data(), x.data(), y.data(), z.data());
+
+    for (i = 0; i < n; i++)
+        orientations[i] = Quaternion(s[i], x[i], y[i], z[i]);
+}
+
+double CarlaPoseConversion::verify(const std::list<carla_api_base::actor_position>& actors) const{
+    double maxError = 0;
+    size_t i = 0;
+    for (auto const &actor : actors){
+        Quaternion expected = Quaternion(EulerAngles(rad(actor.rotation[0]), rad(actor.rotation[1]), rad(actor.rotation[2])));
+        const Quaternion& actual = orientations[i++];
+        maxError = std::max({maxError, std::fabs(expected.s - actual.s), std::fabs(expected.v.x - actual.v.x),
+                             std::fabs(expected.v.y - actual.v.y), std::fabs(expected.v.z - actual.v.z)});
+    }
+    return maxError;
+}
@@ -0,0 +1,60 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+#ifndef CARLAPOSECONVERSION_H_
+#define CARLAPOSECONVERSION_H_
+
+#include <list>
+#include <vector>
+
+#include "inet/common/geometry/common/Coord.h"
+#include "inet/common/geometry/common/Quaternion.h"
+#include "carlaApi.h"
+
+/*
+ * Batch conversion of the poses of a CARLA frame into INET coordinates and quaternions.
+ *
+ * The Euler angles of the whole frame are converted together by a vectorised kernel (AVX2 or SSE2,
+ * chosen at compile time; scalar otherwise) which computes the sines and cosines with the same
+ * polynomial approximation on every lane. Results agree with Quaternion(EulerAngles) within
+ * getTolerance() (see verify()).
+ */
+class CarlaPoseConversion
+{
+public:
+    // Converts the poses of the actors of the frame; the results are indexed as the list
+    void convert(const std::list<carla_api_base::actor_position>& actors);
+
+    size_t size() const { return positions.size(); }
+    const inet::Coord& getPosition(size_t i) const { return positions[i]; }
+    const inet::Coord& getVelocity(size_t i) const { return velocities[i]; }
+    const inet::Quaternion& getOrientation(size_t i) const { return orientations[i]; }
+
+    /**
+     * Checks the last conversion against the scalar INET conversion and returns the maximum
+     * difference of the quaternion components. Meant to be enabled while validating a build.
+     */
+    double verify(const std::list<carla_api_base::actor_position>& actors) const;
+
+    /**
+     * Kernel: (s, x, y, z) = Quaternion(EulerAngles(alpha, beta, gamma)) for n angles, in rad.
+     * The output arrays may not alias the input ones.
+     */
+    static void eulerToQuaternion(size_t n, const double* alpha, const double* beta, const double* gamma,
+                                  double* s, double* x, double* y, double* z);
+
+    // Instruction set used by the kernel ("avx2", "sse2" or "scalar")
+    static const char* getKernelName();
+
+    // Maximum difference of the components w.r.t. the INET conversion
+    static double getTolerance() { return 1e-12; }
+
+private:
+    std::vector<double> alpha, beta, gamma;
+    std::vector<double> s, x, y, z;
+    std::vector<inet::Coord> positions;
+    std::vector<inet::Coord> velocities;
+    std::vector<inet::Quaternion> orientations;
+};
+
+#endif
@@ -0,0 +1,249 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+#ifndef CARLAPOSESTORE_H_
+#define CARLAPOSESTORE_H_
+
+#include <string>
+#include <vector>
+
+#include "omnetpp.h"
+#include "inet/common/geometry/common/Coord.h"
+#include "inet/common/geometry/common/Quaternion.h"
+
+class CarlaInetMobility;
+
+/*
+ * Timestamped pose of an actor, as kept in the pose history.
+ */
+struct CarlaPoseSample
+{
+    omnetpp::simtime_t time;
+    inet::Coord position;
+    inet::Coord velocity;
+    inet::Quaternion orientation;
+};
+
+/*
+ * Read-only view over a contiguous array (a minimal std::span).
+ */
+template <typename T>
+class CarlaSpan
+{
+public:
+    CarlaSpan(const T* data, size_t size) : first(data), count(size) {}
+
+    const T* data() const { return first; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T& operator[](size_t i) const { return first[i]; }
+    const T* begin() const { return first; }
+    const T* end() const { return first + count; }
+
+private:
+    const T* first;
+    size_t count;
+};
+
+
+/*
+ * Struct-of-arrays store of the poses of all the actors with a mobility module, owned by CarlanetManager
+ * and updated in place with each frame. It holds the poses as reported by CARLA (i.e. not extrapolated).
+ *
+ * The arrays are dense: index i of every array refers to the same actor, and removing an actor moves the
+ * last one into its place. So indices are valid only until the next frame; actors are identified across
+ * frames by the handle returned by add() (see getIndex()).
+ *
+ * Optionally, the store also keeps the last poses of each actor (see setHistoryLength()) in a fixed-capacity
+ * ring buffer, for queries about past poses, e.g. where a sender was when a delayed packet was transmitted.
+ */
+class CarlaPoseStore
+{
+public:
+    typedef int Handle;
+
+    // Adds an actor and returns its handle
+    Handle add(const std::string& actorId, CarlaInetMobility* mobility) {
+        Handle handle;
+        if (freeHandles.empty()) {
+            handle = handleToIndex.size();
+            handleToIndex.push_back(0);
+        }
+        else {
+            handle = freeHandles.back();
+            freeHandles.pop_back();
+        }
+        if ((size_t) handle >= historyCounts.size()) {
+            historyStarts.resize(handle + 1);
+            historyCounts.resize(handle + 1);
+            history.resize((handle + 1) * historyLength);
+        }
+        historyStarts[handle] = 0;
+        historyCounts[handle] = 0;
+        handleToIndex[handle] = actorIds.size();
+        indexToHandle.push_back(handle);
+        actorIds.push_back(actorId);
+        modules.push_back(mobility);
+        for (auto array : { &positionX, &positionY, &positionZ, &velocityX, &velocityY, &velocityZ,
+                            &orientationX, &orientationY, &orientationZ })
+            array->push_back(0);
+        orientationS.push_back(1);
+        return handle;
+    }
+
+    void remove(Handle handle) {
+        checkHandle(handle);
+        size_t index = handleToIndex[handle];
+        size_t last = actorIds.size() - 1;
+        if (index != last) {
+            Handle moved = indexToHandle[last];
+            handleToIndex[moved] = index;
+            indexToHandle[index] = moved;
+            actorIds[index] = std::move(actorIds[last]);
+            modules[index] = modules[last];
+            for (auto array : { &positionX, &positionY, &positionZ, &velocityX, &velocityY, &velocityZ,
+                                &orientationS, &orientationX, &orientationY, &orientationZ })
+                (*array)[index] = (*array)[last];
+        }
+        indexToHandle.pop_back();
+        actorIds.pop_back();
+        modules.pop_back();
+        for (auto array : { &positionX, &positionY, &positionZ, &velocityX, &velocityY, &velocityZ,
+                            &orientationS, &orientationX, &orientationY, &orientationZ })
+            array->pop_back();
+        freeHandles.push_back(handle);
+    }
+
+    // Sets the current pose of the actor and appends it to its history (replacing the last sample if it has the same time)
+    void setPose(Handle handle, const inet::Coord& position, const inet::Coord& velocity, const inet::Quaternion& orientation,
+                 omnetpp::simtime_t time) {
+        checkHandle(handle);
+        if (historyLength > 0)
+            appendToHistory(handle, {time, position, velocity, orientation});
+        size_t i = handleToIndex[handle];
+        positionX[i] = position.x;
+        positionY[i] = position.y;
+        positionZ[i] = position.z;
+        velocityX[i] = velocity.x;
+        velocityY[i] = velocity.y;
+        velocityZ[i] = velocity.z;
+        orientationS[i] = orientation.s;
+        orientationX[i] = orientation.v.x;
+        orientationY[i] = orientation.v.y;
+        orientationZ[i] = orientation.v.z;
+    }
+
+    // Number of actors, i.e. size of all the arrays
+    size_t size() const { return actorIds.size(); }
+
+    // Current index of the actor in the arrays
+    size_t getIndex(Handle handle) const { checkHandle(handle); return handleToIndex[handle]; }
+
+    // Bulk read API: views over all the current poses, valid until the next frame
+    CarlaSpan<std::string> getActorIds() const { return span(actorIds); }
+    CarlaSpan<CarlaInetMobility*> getModules() const { return span(modules); }
+    CarlaSpan<double> getPositionsX() const { return span(positionX); }
+    CarlaSpan<double> getPositionsY() const { return span(positionY); }
+    CarlaSpan<double> getPositionsZ() const { return span(positionZ); }
+    CarlaSpan<double> getVelocitiesX() const { return span(velocityX); }
+    CarlaSpan<double> getVelocitiesY() const { return span(velocityY); }
+    CarlaSpan<double> getVelocitiesZ() const { return span(velocityZ); }
+    // Orientation quaternion components (s is the scalar part)
+    CarlaSpan<double> getOrientationsS() const { return span(orientationS); }
+    CarlaSpan<double> getOrientationsX() const { return span(orientationX); }
+    CarlaSpan<double> getOrientationsY() const { return span(orientationY); }
+    CarlaSpan<double> getOrientationsZ() const { return span(orientationZ); }
+
+    // Single pose access, by index
+    inet::Coord getPosition(size_t i) const { return inet::Coord(positionX[i], positionY[i], positionZ[i]); }
+    inet::Coord getVelocity(size_t i) const { return inet::Coord(velocityX[i], velocityY[i], velocityZ[i]); }
+    inet::Quaternion getOrientation(size_t i) const { return inet::Quaternion(orientationS[i], orientationX[i], orientationY[i], orientationZ[i]); }
+
+    /**
+     * Number of poses kept for each actor (0: no history, the default). It must be set before adding actors.
+     * The memory used is historyLength * sizeof(CarlaPoseSample) for each actor (see getHistoryBytes()).
+     */
+    void setHistoryLength(size_t length) { historyLength = length; }
+    size_t getHistoryLength() const { return historyLength; }
+    size_t getHistoryBytes() const { return history.size() * sizeof(CarlaPoseSample); }
+
+    // Number of poses in the history of the actor
+    size_t getHistorySize(Handle handle) const { checkHandle(handle); return historyCounts[handle]; }
+
+    // k-th pose in the history of the actor, from the oldest (0) to the current one (getHistorySize() - 1)
+    const CarlaPoseSample& getHistorySample(Handle handle, size_t k) const {
+        checkHandle(handle);
+        return historySample(handle, k);
+    }
+
+    /**
+     * Returns the pose the actor had at the given time, i.e. the last pose set at or before it,
+     * or nullptr if the time precedes the history of the actor. Binary search, O(log historyLength).
+     */
+    const CarlaPoseSample* getPoseAt(Handle handle, omnetpp::simtime_t time) const {
+        checkHandle(handle);
+        size_t low = 0, high = historyLength > 0 ? historyCounts[handle] : 0;  // first sample after time in [low, high]
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            if (historySample(handle, middle).time <= time)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        return low == 0 ? nullptr : &historySample(handle, low - 1);
+    }
+
+    // Batched getPoseAt() for all the current actors; the result is indexed as the arrays
+    void getPosesAt(omnetpp::simtime_t time, std::vector<const CarlaPoseSample*>& poses) const {
+        poses.resize(size());
+        for (size_t i = 0; i < poses.size(); i++)
+            poses[i] = getPoseAt(indexToHandle[i], time);
+    }
+
+private:
+    // Throws for the handles not returned by add() or already removed, e.g. -1 of the unregistered nodes
+    void checkHandle(Handle handle) const {
+        if (handle < 0 || (size_t) handle >= handleToIndex.size() || handleToIndex[handle] >= indexToHandle.size() ||
+                indexToHandle[handleToIndex[handle]] != handle)
+            throw omnetpp::cRuntimeError("CarlaPoseStore: invalid handle %d (node not registered with CarlanetManager)", handle);
+    }
+
+    const CarlaPoseSample& historySample(Handle handle, size_t k) const {
+        return history[handle * historyLength + (historyStarts[handle] + k) % historyLength];
+    }
+
+    void appendToHistory(Handle handle, const CarlaPoseSample& sample) {
+        CarlaPoseSample* ring = &history[handle * historyLength];
+        size_t& start = historyStarts[handle];
+        size_t& count = historyCounts[handle];
+        if (count > 0 && ring[(start + count - 1) % historyLength].time == sample.time)
+            ring[(start + count - 1) % historyLength] = sample;
+        else if (count < historyLength)
+            ring[(start + count++) % historyLength] = sample;
+        else {
+            ring[start] = sample;
+            start = (start + 1) % historyLength;
+        }
+    }
+
+    template <typename T>
+    static CarlaSpan<T> span(const std::vector<T>& array) { return CarlaSpan<T>(array.data(), array.size()); }
+
+    std::vector<size_t> handleToIndex;
+    std::vector<Handle> indexToHandle;
+    std::vector<Handle> freeHandles;
+
+    std::vector<std::string> actorIds;
+    std::vector<CarlaInetMobility*> modules;
+    std::vector<double> positionX, positionY, positionZ;
+    std::vector<double> velocityX, velocityY, velocityZ;
+    std::vector<double> orientationS, orientationX, orientationY, orientationZ;
+
+    // Pose history: one ring buffer of historyLength samples per handle
+    size_t historyLength = 0;
+    std::vector<CarlaPoseSample> history;
+    std::vector<size_t> historyStarts;
+    std::vector<size_t> historyCounts;
+};
+
+#endif
@@ -0,0 +1,83 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+#ifndef CARLARESPONSECACHE_H_
+#define CARLARESPONSECACHE_H_
+
+#include <string>
+#include <unordered_map>
+
+#include "omnetpp.h"
+#include "../lib/json.hpp"
+
+/*
+ * Cache of the responses to the generic messages marked as cacheable, owned by CarlanetManager
+ * (see sendToAndGetFromCarla()). Responses are keyed by the content of the request, so only
+ * idempotent queries (e.g. map topology, static properties of the actors) should be cached.
+ */
+class CarlaResponseCache
+{
+public:
+    enum Scope {
+        NONE,  // not cached
+        RUN,  // valid until the end of the run
+        STEP,  // valid until the next frame from CARLA
+        TTL  // valid for a given time
+    };
+
+    // Returns the cached response, or nullptr if missing or no longer valid
+    const nlohmann::json* find(const std::string& request, omnetpp::simtime_t now, long frame) {
+        auto it = entries.find(request);
+        if (it == entries.end() || !isValid(it->second, now, frame)) {
+            numMisses++;
+            return nullptr;
+        }
+        numHits++;
+        return &it->second.response;
+    }
+
+    void insert(const std::string& request, const nlohmann::json& response, Scope scope, omnetpp::simtime_t now, long frame,
+                omnetpp::simtime_t ttl = 0) {
+        Entry& entry = entries[request];
+        entry.response = response;
+        entry.scope = scope;
+        entry.frame = frame;
+        entry.expiry = now + ttl;
+    }
+
+    // Drops the entries that are no longer valid, to bound the size of the cache
+    void expire(omnetpp::simtime_t now, long frame) {
+        for (auto it = entries.begin(); it != entries.end();) {
+            if (isValid(it->second, now, frame))
+                ++it;
+            else
+                it = entries.erase(it);
+        }
+    }
+
+    size_t size() const { return entries.size(); }
+    long getNumHits() const { return numHits; }
+    long getNumMisses() const { return numMisses; }
+
+private:
+    struct Entry {
+        nlohmann::json response;
+        Scope scope = RUN;
+        long frame = 0;
+        omnetpp::simtime_t expiry;
+    };
+
+    static bool isValid(const Entry& entry, omnetpp::simtime_t now, long frame) {
+        switch (entry.scope) {
+        case STEP: return entry.frame == frame;
+        case TTL: return now < entry.expiry;
+        default: return true;
+        }
+    }
+
+    std::unordered_map<std::string, Entry> entries;
+    long numHits = 0;
+    long numMisses = 0;
+};
+
+#endif
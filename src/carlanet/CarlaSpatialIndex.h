@@ -0,0 +1,226 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+#ifndef CARLASPATIALINDEX_H_
+#define CARLASPATIALINDEX_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "inet/common/geometry/common/Coord.h"
+
+/*
+ * Uniform grid (spatial hash on the x-y plane) over the actors, updated incrementally with each frame:
+ * an actor is moved between cells only when it crosses a cell border.
+ * Actors are identified by their CarlaPoseStore handle. Distances are 3D.
+ *
+ * The cell size should be about the typical query radius: smaller cells make queries visit many
+ * empty cells, larger ones make them test many actors.
+ */
+class CarlaSpatialIndex
+{
+public:
+    typedef int Handle;
+
+    void setCellSize(double size) { cellSize = size; }
+    double getCellSize() const { return cellSize; }
+
+    // Number of indexed actors
+    size_t size() const { return numActors; }
+
+    // Inserts the actor or moves it to its new position
+    void update(Handle handle, const inet::Coord& position) {
+        if ((size_t) handle >= entries.size())
+            entries.resize(handle + 1);
+        Entry& entry = entries[handle];
+        CellKey key = getCellKey(position.x, position.y);
+        if (!entry.indexed) {
+            insertInCell(handle, key);
+            entry.indexed = true;
+            numActors++;
+        }
+        else if (key != entry.cell) {
+            removeFromCell(handle);
+            insertInCell(handle, key);
+        }
+        entry.position = position;
+    }
+
+    void remove(Handle handle) {
+        if ((size_t) handle >= entries.size() || !entries[handle].indexed)
+            return;
+        removeFromCell(handle);
+        entries[handle].indexed = false;
+        numActors--;
+    }
+
+    void clear() {
+        entries.clear();
+        cells.clear();
+        numActors = 0;
+    }
+
+    const inet::Coord& getPosition(Handle handle) const { return entries[handle].position; }
+
+    // Appends to result the actors within radius from center
+    void getInRange(const inet::Coord& center, double radius, std::vector<Handle>& result) const {
+        double radius2 = radius * radius;
+        forEachCell(center.x - radius, center.y - radius, center.x + radius, center.y + radius, [&] (const std::vector<Handle>& cell) {
+            for (auto handle : cell)
+                if (entries[handle].position.sqrdist(center) <= radius2)
+                    result.push_back(handle);
+        });
+    }
+
+    // Appends to result the actors inside the rectangle (on the x-y plane)
+    void getInRegion(double xMin, double yMin, double xMax, double yMax, std::vector<Handle>& result) const {
+        forEachCell(xMin, yMin, xMax, yMax, [&] (const std::vector<Handle>& cell) {
+            for (auto handle : cell) {
+                auto& position = entries[handle].position;
+                if (position.x >= xMin && position.x <= xMax && position.y >= yMin && position.y <= yMax)
+                    result.push_back(handle);
+            }
+        });
+    }
+
+    /**
+     * Appends to result the actors of the cells within margin from the segment between a and b (on the x-y plane),
+     * i.e. a superset of the actors within margin from it. Only the cells along the segment are visited.
+     */
+    void getNearSegment(const inet::Coord& a, const inet::Coord& b, double margin, std::vector<Handle>& result) const {
+        double xMin = std::min(a.x, b.x), xMax = std::max(a.x, b.x);
+        double slope = a.x != b.x ? (b.y - a.y) / (b.x - a.x) : 0;
+        for (int64_t ix = getCellIndex(xMin - margin); ix <= getCellIndex(xMax + margin); ix++) {
+            // Part of the segment which is within margin from the column along x...
+            double x0 = std::max(xMin, std::min(xMax, ix * cellSize - margin));
+            double x1 = std::max(xMin, std::min(xMax, (ix + 1) * cellSize + margin));
+            // ...and the cells it spans along y
+            double y0 = a.x != b.x ? a.y + (x0 - a.x) * slope : a.y;
+            double y1 = a.x != b.x ? a.y + (x1 - a.x) * slope : b.y;
+            int64_t iyMax = getCellIndex(std::max(y0, y1) + margin);
+            for (int64_t iy = getCellIndex(std::min(y0, y1) - margin); iy <= iyMax; iy++) {
+                auto it = cells.find(makeCellKey(ix, iy));
+                if (it != cells.end())
+                    result.insert(result.end(), it->second.begin(), it->second.end());
+            }
+        }
+    }
+
+    /**
+     * Appends to result the k actors nearest to center (not farther than maxDistance), from the nearest,
+     * skipping the excluded one (e.g. the actor asking). The cells are visited in rings of increasing
+     * distance, until no unvisited cell can contain a nearer actor.
+     */
+    void getNearest(const inet::Coord& center, size_t k, std::vector<Handle>& result,
+                    double maxDistance = std::numeric_limits<double>::infinity(), Handle excluded = -1) const {
+        if (k == 0 || numActors == 0)
+            return;
+        std::priority_queue<std::pair<double, Handle>> nearest;  // max-heap of the best k (squared distance, handle)
+        double maxDistance2 = maxDistance * maxDistance;
+        int64_t cx = getCellIndex(center.x), cy = getCellIndex(center.y);
+        size_t numVisited = 0;
+        for (int64_t ring = 0; numVisited < numActors; ring++) {
+            // Any actor in this ring or beyond is at least (ring - 1) cells away from the center
+            double ringDistance = std::max<int64_t>(0, ring - 1) * cellSize;
+            if (ringDistance * ringDistance > maxDistance2)
+                break;
+            if (nearest.size() == k && ringDistance * ringDistance > nearest.top().first)
+                break;
+            for (int64_t ix = cx - ring; ix <= cx + ring; ix++) {
+                bool edgeColumn = ix == cx - ring || ix == cx + ring;
+                for (int64_t iy = cy - ring; iy <= cy + ring; iy += (edgeColumn ? 1 : 2 * ring)) {
+                    auto it = cells.find(makeCellKey(ix, iy));
+                    if (it != cells.end()) {
+                        numVisited += it->second.size();
+                        for (auto handle : it->second) {
+                            double distance2 = entries[handle].position.sqrdist(center);
+                            if (handle == excluded || distance2 > maxDistance2)
+                                continue;
+                            if (nearest.size() < k)
+                                nearest.push({distance2, handle});
+                            else if (distance2 < nearest.top().first) {
+                                nearest.pop();
+                                nearest.push({distance2, handle});
+                            }
+                        }
+                    }
+                    if (ring == 0)
+                        break;
+                }
+            }
+        }
+        size_t first = result.size();
+        result.resize(first + nearest.size());
+        for (size_t i = result.size(); i > first; i--) {
+            result[i - 1] = nearest.top().second;
+            nearest.pop();
+        }
+    }
+
+private:
+    typedef uint64_t CellKey;
+
+    struct Entry {
+        inet::Coord position;
+        CellKey cell = 0;
+        size_t slot = 0;  // position in the vector of the cell
+        bool indexed = false;
+    };
+
+    int64_t getCellIndex(double coordinate) const { return (int64_t) std::floor(coordinate / cellSize); }
+    static CellKey makeCellKey(int64_t ix, int64_t iy) { return ((CellKey) (uint32_t) ix << 32) | (uint32_t) iy; }
+    CellKey getCellKey(double x, double y) const { return makeCellKey(getCellIndex(x), getCellIndex(y)); }
+
+    void insertInCell(Handle handle, CellKey key) {
+        auto& cell = cells[key];
+        entries[handle].cell = key;
+        entries[handle].slot = cell.size();
+        cell.push_back(handle);
+    }
+
+    void removeFromCell(Handle handle) {
+        auto it = cells.find(entries[handle].cell);
+        auto& cell = it->second;
+        size_t slot = entries[handle].slot;
+        cell[slot] = cell.back();
+        entries[cell[slot]].slot = slot;
+        cell.pop_back();
+        if (cell.empty())
+            cells.erase(it);
+    }
+
+    // Calls f on the non-empty cells overlapping the rectangle
+    template <typename F>
+    void forEachCell(double xMin, double yMin, double xMax, double yMax, F f) const {
+        int64_t ixMin = getCellIndex(xMin), ixMax = getCellIndex(xMax);
+        int64_t iyMin = getCellIndex(yMin), iyMax = getCellIndex(yMax);
+        if ((double) (ixMax - ixMin + 1) * (iyMax - iyMin + 1) > cells.size()) {
+            // Large areas: scanning the occupied cells is cheaper than looking up every cell of the area
+            for (auto const &item : cells) {
+                int64_t ix = (int32_t) (item.first >> 32), iy = (int32_t) (uint32_t) item.first;
+                if (ix >= ixMin && ix <= ixMax && iy >= iyMin && iy <= iyMax)
+                    f(item.second);
+            }
+            return;
+        }
+        for (int64_t ix = ixMin; ix <= ixMax; ix++)
+            for (int64_t iy = iyMin; iy <= iyMax; iy++) {
+                auto it = cells.find(makeCellKey(ix, iy));
+                if (it != cells.end())
+                    f(it->second);
+            }
+    }
+
+    double cellSize = 50;
+    size_t numActors = 0;
+    std::vector<Entry> entries;  // by handle
+    std::unordered_map<CellKey, std::vector<Handle>> cells;
+};
+
+#endif
@@ -0,0 +1,138 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+#ifndef CARLASTATICGEOMETRY_H_
+#define CARLASTATICGEOMETRY_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "CarlaBox.h"
+
+/*
+ * Static geometry of the CARLA map (buildings, walls, poles, ...) as oriented boxes, imported once
+ * by CarlanetManager (see its importStaticGeometry parameter).
+ * Each box is registered in all the cells of a uniform grid (on the x-y plane) that its enclosing
+ * rectangle overlaps, so that line-of-sight queries test only the boxes along the line.
+ */
+class CarlaStaticGeometry
+{
+public:
+    struct Object {
+        std::string label;  // CARLA semantic label, e.g. "Buildings"
+        std::string material;  // INET material name
+        CarlaBox box;
+        double rotation[3];  // same angles as the actors, rad
+    };
+
+    // Object crossed by a segment
+    struct Intersection {
+        size_t object;
+        double length;  // length of the part of the segment inside the object
+    };
+
+    void setCellSize(double size) { cellSize = size; }
+
+    size_t size() const { return objects.size(); }
+    const Object& get(size_t i) const { return objects[i]; }
+
+    void add(const Object& object) {
+        size_t index = objects.size();
+        objects.push_back(object);
+        visitStamps.push_back(0);
+        inet::Coord enclosing = object.box.getEnclosingHalfExtent();
+        const inet::Coord& center = object.box.center;
+        for (int64_t ix = getCellIndex(center.x - enclosing.x); ix <= getCellIndex(center.x + enclosing.x); ix++)
+            for (int64_t iy = getCellIndex(center.y - enclosing.y); iy <= getCellIndex(center.y + enclosing.y); iy++)
+                cells[makeCellKey(ix, iy)].push_back(index);
+    }
+
+    /**
+     * Appends to result the objects crossed by the segment between a and b, with the length of the crossing
+     * (including the parts of the segment that start or end inside an object, e.g. indoors).
+     * Returns the number of objects tested.
+     */
+    size_t getIntersections(const inet::Coord& a, const inet::Coord& b, std::vector<Intersection>& result) const {
+        size_t numTested = 0;
+        forEachObjectAlongSegment(a, b, [&] (size_t i) {
+            numTested++;
+            double length = objects[i].box.getCrossingLength(a, b);
+            if (length > 0)
+                result.push_back({i, length});
+            return true;
+        });
+        return numTested;
+    }
+
+    // Returns true if no object is crossed by the segment between a and b; stops at the first one found
+    bool hasLineOfSight(const inet::Coord& a, const inet::Coord& b) const {
+        bool lineOfSight = true;
+        forEachObjectAlongSegment(a, b, [&] (size_t i) {
+            lineOfSight = objects[i].box.getCrossingLength(a, b) == 0;
+            return lineOfSight;
+        });
+        return lineOfSight;
+    }
+
+    /**
+     * Writes the objects as an INET physical environment, to be loaded by PhysicalEnvironment
+     * (e.g. for the INET TracingObstacleLoss or the visualizers).
+     */
+    void exportXml(std::ostream& stream) const {
+        stream << "<environment>\n";
+        for (auto const &object : objects) {
+            auto& box = object.box;
+            stream << "  <object position=\"center " << box.center.x << " " << box.center.y << " " << box.center.z << "\""
+                   << " orientation=\"" << object.rotation[0] * 180 / M_PI << " " << object.rotation[1] * 180 / M_PI << " " << object.rotation[2] * 180 / M_PI << "\""
+                   << " shape=\"cuboid " << 2 * box.halfExtent.x << " " << 2 * box.halfExtent.y << " " << 2 * box.halfExtent.z << "\""
+                   << " material=\"" << object.material << "\" name=\"" << object.label << "\"/>\n";
+        }
+        stream << "</environment>\n";
+    }
+
+private:
+    typedef uint64_t CellKey;
+
+    int64_t getCellIndex(double coordinate) const { return (int64_t) std::floor(coordinate / cellSize); }
+    static CellKey makeCellKey(int64_t ix, int64_t iy) { return ((CellKey) (uint32_t) ix << 32) | (uint32_t) iy; }
+
+    // Calls f once for each object registered in the cells along the segment, until f returns false
+    template <typename F>
+    void forEachObjectAlongSegment(const inet::Coord& a, const inet::Coord& b, F f) const {
+        currentStamp++;
+        double xMin = std::min(a.x, b.x), xMax = std::max(a.x, b.x);
+        double slope = a.x != b.x ? (b.y - a.y) / (b.x - a.x) : 0;
+        for (int64_t ix = getCellIndex(xMin); ix <= getCellIndex(xMax); ix++) {
+            double x0 = std::max(xMin, ix * cellSize);
+            double x1 = std::min(xMax, (ix + 1) * cellSize);
+            double y0 = a.x != b.x ? a.y + (x0 - a.x) * slope : a.y;
+            double y1 = a.x != b.x ? a.y + (x1 - a.x) * slope : b.y;
+            int64_t iyMax = getCellIndex(std::max(y0, y1));
+            for (int64_t iy = getCellIndex(std::min(y0, y1)); iy <= iyMax; iy++) {
+                auto it = cells.find(makeCellKey(ix, iy));
+                if (it == cells.end())
+                    continue;
+                for (auto i : it->second) {
+                    if (visitStamps[i] == currentStamp)
+                        continue;  // large objects are in several cells
+                    visitStamps[i] = currentStamp;
+                    if (!f(i))
+                        return;
+                }
+            }
+        }
+    }
+
+    double cellSize = 50;
+    std::vector<Object> objects;
+    std::unordered_map<CellKey, std::vector<size_t>> cells;
+    mutable std::vector<unsigned long> visitStamps;  // by object, to test each one once per query
+    mutable unsigned long currentStamp = 0;
+};
+
+#endif
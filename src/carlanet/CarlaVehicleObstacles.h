@@ -0,0 +1,98 @@
+// MIT License
+// Copyright (c) 2023 Valerio Cislaghi, Christian Quadri
+
+#ifndef CARLAVEHICLEOBSTACLES_H_
+#define CARLAVEHICLEOBSTACLES_H_
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "inet/common/geometry/common/Coord.h"
+#include "inet/common/geometry/common/Quaternion.h"
+#include "CarlaBox.h"
+#include "CarlaSpatialIndex.h"
+
+/*
+ * Bodies of the vehicles as oriented boxes, owned by CarlanetManager and updated incrementally with
+ * each frame (see CarlaSpatialIndex), for the obstacle loss of the radio medium.
+ * A box stands on the position of the actor (i.e. the position is the centre of its bottom face),
+ * with the size given by the half extents (as the bounding boxes of CARLA) and the orientation of the actor.
+ * Actors are identified by their CarlaPoseStore handle; those without extent are not obstacles.
+ */
+class CarlaVehicleObstacles
+{
+public:
+    typedef CarlaSpatialIndex::Handle Handle;
+
+    // Body intersected by a segment
+    struct Intersection {
+        Handle handle;
+        double length;  // length of the part of the segment inside the body
+    };
+
+    void setCellSize(double size) { grid.setCellSize(size); }
+
+    // Number of bodies
+    size_t size() const { return grid.size(); }
+
+    void setExtent(Handle handle, const inet::Coord& halfExtent) {
+        if ((size_t) handle >= bodies.size())
+            bodies.resize(handle + 1);
+        bodies[handle].box.halfExtent = halfExtent;
+        bodies[handle].hasExtent = true;
+        maxHalfDiagonal = std::max(maxHalfDiagonal, std::hypot(halfExtent.x, halfExtent.y));
+    }
+
+    bool hasExtent(Handle handle) const { return (size_t) handle < bodies.size() && bodies[handle].hasExtent; }
+
+    // Moves the body of the actor (if it has an extent)
+    void update(Handle handle, const inet::Coord& position, const inet::Quaternion& orientation) {
+        if (!hasExtent(handle))
+            return;
+        Body& body = bodies[handle];
+        body.box.center = position + inet::Coord(0, 0, body.box.halfExtent.z);
+        body.box.setOrientation(orientation);
+        grid.update(handle, position);
+    }
+
+    void remove(Handle handle) {
+        if ((size_t) handle >= bodies.size())
+            return;
+        grid.remove(handle);
+        bodies[handle] = Body();
+    }
+
+    /**
+     * Appends to result the bodies crossed by the segment between a and b, with the length of the crossing.
+     * The bodies containing a or b (e.g. the ones of the transmitter and receiver, whose antennas are on
+     * the vehicle) are not obstacles. Only the bodies near the segment are tested.
+     * Returns the number of bodies tested.
+     */
+    size_t getIntersections(const inet::Coord& a, const inet::Coord& b, std::vector<Intersection>& result) const {
+        candidates.clear();
+        grid.getNearSegment(a, b, maxHalfDiagonal, candidates);
+        for (auto handle : candidates) {
+            auto& body = bodies[handle].box;
+            if (body.contains(a) || body.contains(b))
+                continue;
+            double length = body.getCrossingLength(a, b);
+            if (length > 0)
+                result.push_back({handle, length});
+        }
+        return candidates.size();
+    }
+
+private:
+    struct Body {
+        CarlaBox box;
+        bool hasExtent = false;
+    };
+
+    CarlaSpatialIndex grid;
+    std::vector<Body> bodies;  // by handle
+    double maxHalfDiagonal = 0;  // on the x-y plane, margin of the candidate search
+    mutable std::vector<Handle> candidates;
+};
+
+#endif
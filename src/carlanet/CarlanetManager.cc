@@ -4,7 +4,10 @@
 
 #include "CarlanetManager.h"
 
+#include <climits>
 #include <stdexcept>
+#include <fstream>
+#include <iterator>
 
 #include "inet/applications/base/ApplicationPacket_m.h"
 #include "inet/common/ModuleAccess.h"
@@ -23,16 +26,65 @@ Define_Module(CarlanetManager);
 using namespace inet;
 using namespace std;
 
+static simsignal_t materializedActorsSignal = cComponent::registerSignal("materializedActors");
+static simsignal_t dataOnlyActorsSignal = cComponent::registerSignal("dataOnlyActors");
+static simsignal_t frameActorsSignal = cComponent::registerSignal("frameActors");
+static simsignal_t frameReductionSignal = cComponent::registerSignal("frameReduction");
+static simsignal_t frameSizeSignal = cComponent::registerSignal("frameSize");
+static simsignal_t frameDecodeTimeSignal = cComponent::registerSignal("frameDecodeTime");
+static simsignal_t outsideActorsSignal = cComponent::registerSignal("outsideActors");
+static simsignal_t actorCreationBatchSizeSignal = cComponent::registerSignal("actorCreationBatchSize");
+static simsignal_t actorCreationBatchTimeSignal = cComponent::registerSignal("actorCreationBatchTime");
+static simsignal_t carlaStepCompletedSignal = cComponent::registerSignal("carlaStepCompleted");
+
 CarlanetManager::CarlanetManager(){
 
 }
 CarlanetManager::~CarlanetManager(){
     cancelAndDelete(simulationTimeStepEvent);
+    cancelAndDelete(asyncRequestsEvent);
 }
 
 
 void CarlanetManager::finish(){
-
+    recordScalar("initializationWallTime", initializationWallTime);
+    recordScalar("startupWallTime", startupWallTime);
+    recordScalar("initBuildWallTime", initBuildWallTime);
+    if (numInitActors > 0)
+        recordScalar("initBuildWallTimePer1kActors", initBuildWallTime * 1000 / numInitActors);
+    recordScalar("numActorConfigurations", actorConfigurations.size());
+    recordScalar("actorConfigurationBytes", actorConfigurations.getSerializedBytes());
+    recordScalar("unsharedActorConfigurationBytes", actorConfigurations.getUnsharedBytes());
+    if (importStaticGeometry){
+        recordScalar("numStaticObjects", staticGeometry.size());
+        recordScalar("staticGeometryLoadTime", staticGeometryLoadTime);
+    }
+    if (poseStore.getHistoryLength() > 0)
+        recordScalar("poseHistoryBytes", poseStore.getHistoryBytes());
+    if (numCommands > 0){
+        recordScalar("numDeferredCommands", numCommands);
+        recordScalar("deferredCommandsPerStep", (double) numCommands / numCommandSteps);
+    }
+    if (responseCache.getNumHits() + responseCache.getNumMisses() > 0){
+        recordScalar("numResponseCacheHits", responseCache.getNumHits());
+        recordScalar("numResponseCacheMisses", responseCache.getNumMisses());
+    }
+    if (numAsyncRequests > 0){
+        recordScalar("numAsyncRequests", numAsyncRequests);
+        recordScalar("asyncRequestsPerBatch", (double) numAsyncRequests / numAsyncBatches);
+    }
+    if (dynamicNetworkPromotion){
+        for (auto& item: actorRecords){
+            auto& record = item.second;
+            simtime_t materializedTime = record.materializedTime;
+            if (record.materialized)
+                materializedTime += simTime() - record.materializedSince;
+            recordScalar((item.first + ":materializedTime").c_str(), materializedTime);
+            recordScalar((item.first + ":numPromotions").c_str(), record.numPromotions);
+        }
+        recordScalar("numPromotions", numPromotions);
+        recordScalar("numDemotions", numDemotions);
+    }
 }
 
 
@@ -45,9 +97,54 @@ void CarlanetManager::initialize(int stage)
         port = par("port").intValue();
         timeout_ms = par("communicationTimeoutms");
         simulationTimeStep = par("simulationTimeStep");
+        initChunkSize = par("initChunkSize");
+        useConfigurationTemplates = par("useConfigurationTemplates");
+        typedMessageChannels = par("typedMessageChannels");
+        responseCacheEnabled = par("responseCache");
 
         networkActiveModuleType = par("networkActiveModuleType").stringValue();
         networkPassiveModuleType = par("networkPassiveModuleType").stringValue();
+        batchedActorCreation = par("batchedActorCreation");
+        std::string notificationMode = par("stepNotification").stdstringValue();
+        perModuleStepNotification = notificationMode != "bulk";
+        bulkStepNotification = notificationMode != "perModule";
+        batchPoseConversion = par("batchPoseConversion");
+        verifyPoseConversion = par("verifyPoseConversion");
+        if (batchPoseConversion)
+            EV_INFO << "Pose conversion kernel: " << CarlaPoseConversion::getKernelName() << endl;
+
+        dynamicNetworkPromotion = par("dynamicNetworkPromotion");
+        interestRange = par("interestRange");
+        interestHysteresis = par("interestHysteresis");
+        interestRegions = parseRegions(check_and_cast<cValueArray*>(par("interestRegions").objectValue()));
+        cStringTokenizer tokenizer(par("interestAnchorModules"));
+        while (tokenizer.hasMoreTokens()){
+            const char* anchorPath = tokenizer.nextToken();
+            auto anchor = getModuleByPath(anchorPath);
+            if (anchor == nullptr)
+                throw cRuntimeError("Interest anchor module '%s' not found", anchorPath);
+            interestAnchors.push_back(check_and_cast<IMobility*>(anchor->getSubmodule("mobility")));
+        }
+
+        areaOfInterestFiltering = par("areaOfInterestFiltering");
+        areasOfInterest = parseRegions(check_and_cast<cValueArray*>(par("areasOfInterest").objectValue()));
+        areaOfInterestRadius = par("areaOfInterestRadius");
+        areaOfInterestRefreshInterval = par("areaOfInterestRefreshInterval");
+
+        updateDivisors = check_and_cast<cValueMap*>(par("updateDivisors").objectValue());
+        poseStore.setHistoryLength(par("poseHistoryLength").intValue());
+        spatialIndexEnabled = par("spatialIndexCellSize").doubleValue() > 0;
+        if (spatialIndexEnabled)
+            spatialIndex.setCellSize(par("spatialIndexCellSize"));
+        vehicleObstaclesEnabled = par("vehicleObstacles");
+        vehicleObstacles.setCellSize(par("vehicleObstacleCellSize"));
+        importStaticGeometry = par("importStaticGeometry");
+        staticGeometry.setCellSize(par("staticGeometryCellSize"));
+        cStringTokenizer attributeTokenizer(par("actorAttributes"));
+        while (attributeTokenizer.hasMoreTokens())
+            actorAttributes.subscribe(attributeTokenizer.nextToken());
+        // Flushed after the other events of the same time
+        asyncRequestsEvent->setSchedulingPriority(SHRT_MAX);
         connect();
     }
 
@@ -57,20 +154,43 @@ void CarlanetManager::initialize(int stage)
 }
 
 
-void CarlanetManager::registerMobilityModule(CarlaInetMobility *mod){
-    const char* mobileNodeName = mod->getParentModule()->getFullName();
-    modulesToTrack.insert(pair<string,CarlaInetMobility*>(string(mobileNodeName), mod));
+void CarlanetManager::flushRegistrations(){
+    for (auto mod : pendingRegistrations){
+        mod->setStepNotification(perModuleStepNotification);
+        const char* mobileNodeName = mod->getParentModule()->getFullName();
+        mod->setPoseStoreHandle(poseStore.add(mobileNodeName, mod));
+        if (vehicleObstaclesEnabled)
+            setVehicleExtent(mod);
+        modulesToTrack.emplace(string(mobileNodeName), mod);
+        seedActorPose(mod);
+    }
+    pendingRegistrations.clear();
 }
 
 
 void CarlanetManager::initializeCarla(){
+    auto initializationStart = chrono::steady_clock::now();
+    flushRegistrations();
     // conversion
-    auto movingActorList = list<carla_api_base::init_actor>();
-    for(auto elem: modulesToTrack){
+    json actorTemplates = json::object();
+    auto movingActorList = vector<carla_api_base::init_actor>();
+    movingActorList.reserve(modulesToTrack.size());
+    for(auto const& elem: modulesToTrack){
         carla_api_base::init_actor actor;
         actor.actor_id = elem.first;
         actor.actor_type = elem.second->getCarlaActorType();
-        actor.actor_configuration = elem.second->getCarlaActorConfiguration()->getFields();
+        // Identical configurations are shared, so they are converted only once
+        auto configuration = elem.second->getSharedCarlaActorConfiguration();
+        if (useConfigurationTemplates){
+            if (!actorTemplates.contains(configuration->getName()))
+                actorTemplates[configuration->getName()] = configuration->getJson();
+            actor.actor_template = configuration->getName();
+        }
+        else{
+            actor.shared_configuration = &configuration->getJson();  // copied only into the message
+        }
+        actor.update_divisor = getUpdateDivisor(elem.second);
+        actorSchedules[elem.first].updateDivisor = actor.update_divisor;
         movingActorList.push_back(actor);
     }
 
@@ -84,25 +204,71 @@ void CarlanetManager::initializeCarla(){
     msg.carla_configuration.seed = stoi(getEnvir()->getConfigEx()->getVariable(CFGVAR_SEEDSET));
     msg.carla_configuration.carla_timestep = simulationTimeStep;
     msg.carla_configuration.sim_time_limit = simTimeLimit != nullptr ? stod(simTimeLimit) : -1.0 ;
-    msg.moving_actors = movingActorList;
+    msg.carla_configuration.update_divisors = updateDivisors->getFields();
     msg.user_defined = getExtraInitParams();
     msg.timestamp = simTime().dbl();
+    if (areaOfInterestFiltering)
+        msg.areas_of_interest = getAreasOfInterest();
+    if (useConfigurationTemplates)
+        msg.actor_templates = actorTemplates;
+    if (!actorAttributes.empty())
+        msg.attribute_subscriptions = actorAttributes.getSubscriptions();
+
+    // The actors are sent in chunks: the first one with the INIT message, the others with INIT_CHUNK messages
+    size_t chunkSize = initChunkSize > 0 ? initChunkSize : max<size_t>(movingActorList.size(), 1);
+    size_t numSentActors = min(chunkSize, movingActorList.size());
+    msg.moving_actors.assign(movingActorList.begin(), movingActorList.begin() + numSentActors);
+    msg.has_more_chunks = numSentActors < movingActorList.size();
+    bool chunked = msg.has_more_chunks;
+    numInitActors = movingActorList.size();
 
     json jsonMsg = msg;
+    initBuildWallTime = chrono::duration<double>(chrono::steady_clock::now() - initializationStart).count();
 
     EV << jsonMsg.dump() << endl;
     sendToCarla(jsonMsg);
+    while (numSentActors < movingActorList.size()){
+        auto chunkResponse = receiveFromCarla<carla_api::init_chunk_completed>(100.0);
+
+        carla_api::init_chunk chunk;
+        size_t numChunkActors = min(chunkSize, movingActorList.size() - numSentActors);
+        chunk.timestamp = simTime().dbl();
+        chunk.moving_actors.assign(movingActorList.begin() + numSentActors, movingActorList.begin() + numSentActors + numChunkActors);
+        numSentActors += numChunkActors;
+        chunk.has_more_chunks = numSentActors < movingActorList.size();
+        json jsonChunk = chunk;
+        sendToCarla(jsonChunk);
+
+        // CARLA spawns the actors of the next chunk while the modules of the previous one are set up
+        updateNodesPosition(chunkResponse.actor_positions, false);
+    }
     // I expect to receive INIT_COMPLETE message
     carla_api::init_completed response = receiveFromCarla<carla_api::init_completed>(100.0);
     // Carla informs about the intial timestamp, so I schedule the first similation step at that timestamp
     EV << "Initialization completed" << response.initial_timestamp <<  endl;
-    updateNodesPosition(response.actor_positions);
+    // When chunked, only the first simulation step reports all the actors
+    actorAttributes.update(response.actor_attributes);
+    updateNodesPosition(response.actor_positions, !chunked);
     //
     initial_timestamp = simTime() + response.initial_timestamp;
+    if (importStaticGeometry)
+        loadStaticGeometry();
+    initializationWallTime = chrono::duration<double>(chrono::steady_clock::now() - initializationStart).count();
+    startupWallTime = chrono::duration<double>(chrono::steady_clock::now() - constructionTime).count();
     // schedule
     scheduleAt(simTime() + response.initial_timestamp, simulationTimeStepEvent);
 }
 
+int CarlanetManager::getUpdateDivisor(CarlaInetMobility* mobility){
+    auto configuration = mobility->getCarlaActorConfiguration();
+    if (configuration->containsKey("update_divisor"))
+        return configuration->get("update_divisor").intValue();
+    auto actorType = mobility->getCarlaActorType();
+    if (updateDivisors->containsKey(actorType.c_str()))
+        return updateDivisors->get(actorType.c_str()).intValue();
+    return 1;
+}
+
 const std::map<std::string,cValue>& CarlanetManager::getExtraInitParams(){
     return check_and_cast<cValueMap*>(par("extraInitParams").objectValue())->getFields();
 }
@@ -112,41 +278,461 @@ void CarlanetManager::doSimulationTimeStep(){
     carla_api::simulation_step msg;
     msg.carla_timestep = simulationTimeStep;
     msg.timestamp = simTime().dbl();
+    if (areaOfInterestFiltering){
+        if (areaOfInterestRefreshInterval > 0 && simTime() >= lastAreasOfInterestDeclaration + areaOfInterestRefreshInterval)
+            areasOfInterestChanged = true;
+        if (areasOfInterestChanged)
+            msg.areas_of_interest = getAreasOfInterest();
+    }
+    msg.spawn_requests.swap(pendingSpawnRequests);
+    msg.despawn_requests.swap(pendingDespawnRequests);
+    if (actorAttributes.hasSubscriptionsChanged())
+        msg.attribute_subscriptions = actorAttributes.getSubscriptions();
+    if (!pendingCommands.empty()){
+        numCommands += pendingCommands.size();
+        numCommandSteps++;
+        msg.commands.swap(pendingCommands);
+    }
     json jsonMsg = msg;
     sendToCarla(jsonMsg);
     // I expect updated_postion message
-    carla_api::updated_postion response = receiveFromCarla<carla_api::updated_postion>();
+    zmq::message_t reply = receiveRawFromCarla(1);
+    auto decodeStart = chrono::steady_clock::now();  // not before, the wait for CARLA is not decoding time
+    json jsonResp = json::parse(reply.to_string());
+    checkSimulationStatus(jsonResp["simulation_status"].get<int>());
+    carla_api::updated_postion response = jsonResp.get<carla_api::updated_postion>();
+    emit(frameDecodeTimeSignal, chrono::duration<double>(chrono::steady_clock::now() - decodeStart).count());
+    emit(frameSizeSignal, (long) lastMessageSize);
+    if (areaOfInterestFiltering)
+        emit(outsideActorsSignal, (long) response.num_outside_actors);
 
     //Update position of all nodes in response
+    //NOTE with area-of-interest filtering, actors missing from the frame have left the areas and are destroyed
+    for (auto const &actorId : response.despawned_actors){
+        auto schedule = actorSchedules.find(actorId);
+        if (schedule != actorSchedules.end())
+            schedule->second.updateDivisor = 0;  // destroyed in this frame, even if it is not its turn
+    }
 
+    actorAttributes.update(response.actor_attributes);
     updateNodesPosition(response.actor_positions);
+    if (responseCache.size() > 0)
+        responseCache.expire(simTime(), frameIndex);
+    notifySpawnOutcomes(response.spawned_actors);
+    notifyCommandResponses(response.command_responses);
+}
+
+
+/* ***********************************
+ * Spawn and despawn requests
+ * ********************************** */
+int CarlanetManager::requestSpawn(const std::string& actorType, const json& actorConfiguration, bool isNetActive, ISpawnCallback* callback){
+    Enter_Method("requestSpawn");
+    carla_api_base::spawn_request request;
+    request.request_id = nextSpawnRequestId++;
+    request.actor_type = actorType;
+    request.actor_configuration = actorConfiguration;
+    request.is_net_active = isNetActive;
+    pendingSpawnRequests.push_back(request);
+    if (callback != nullptr)
+        spawnCallbacks[request.request_id] = callback;
+    return request.request_id;
+}
+
+void CarlanetManager::requestDespawn(const std::string& actorId){
+    Enter_Method("requestDespawn");
+    pendingDespawnRequests.push_back(actorId);
+}
+
+void CarlanetManager::cancelSpawnRequests(ISpawnCallback* callback){
+    for (auto it = spawnCallbacks.begin(); it != spawnCallbacks.end();){
+        if (it->second == callback)
+            it = spawnCallbacks.erase(it);
+        else
+            ++it;
+    }
+}
+
+void CarlanetManager::notifySpawnOutcomes(const std::list<carla_api_base::spawned_actor>& spawnedActors){
+    // Requests are answered within the step they are sent with, so the callbacks left are the failed ones;
+    // the ones requested while the frame was processed (ids from the first pending one) wait for the next step
+    int firstUnsentId = pendingSpawnRequests.empty() ? nextSpawnRequestId : pendingSpawnRequests.front().request_id;
+    auto sentEnd = spawnCallbacks.lower_bound(firstUnsentId);
+    auto callbacks = map<int,ISpawnCallback*>(spawnCallbacks.begin(), sentEnd);
+    spawnCallbacks.erase(spawnCallbacks.begin(), sentEnd);
+    for (auto const &spawned : spawnedActors){
+        auto it = callbacks.find(spawned.request_id);
+        if (it == callbacks.end())
+            continue;
+        auto mobility = modulesToTrack.find(spawned.actor_id);
+        cModule* module = mobility != modulesToTrack.end() ? mobility->second->getParentModule() : nullptr;
+        it->second->actorSpawned(spawned.request_id, spawned.actor_id, module);
+        callbacks.erase(it);
+    }
+    for (auto const &item : callbacks)
+        item.second->actorSpawnFailed(item.first);
+}
+
+/* ***********************************
+ * Actor attributes
+ * ********************************** */
+CarlaActorAttributes::AttributeId CarlanetManager::subscribeActorAttribute(const std::string& attribute, const std::string& actorId){
+    Enter_Method("subscribeActorAttribute");
+    return actorAttributes.subscribe(attribute, actorId);
+}
+
+
+/* ***********************************
+ * Deferred commands
+ * ********************************** */
+int CarlanetManager::enqueueCommand(const json& command, ICommandCallback* callback){
+    Enter_Method("enqueueCommand");
+    carla_api_base::command deferred;
+    deferred.command_id = nextCommandId++;
+    deferred.user_defined = command;
+    pendingCommands.push_back(deferred);
+    if (callback != nullptr)
+        commandCallbacks[deferred.command_id] = callback;
+    return deferred.command_id;
+}
+
+void CarlanetManager::cancelCommands(ICommandCallback* callback){
+    for (auto callbacks : { &commandCallbacks, &asyncCallbacks }){
+        for (auto it = callbacks->begin(); it != callbacks->end();){
+            if (it->second == callback)
+                it = callbacks->erase(it);
+            else
+                ++it;
+        }
+    }
 }
 
-void CarlanetManager::updateNodesPosition(std::list<carla_api_base::actor_position> actors){
+void CarlanetManager::notifyCommandResponses(const std::list<carla_api_base::command_response>& responses){
+    // As the spawn requests, commands are answered within the step they are sent with; the ones
+    // enqueued while the frame was processed (ids from the first pending one) wait for the next step
+    int firstUnsentId = pendingCommands.empty() ? nextCommandId : pendingCommands.front().command_id;
+    auto sentEnd = commandCallbacks.lower_bound(firstUnsentId);
+    auto callbacks = map<int,ICommandCallback*>(commandCallbacks.begin(), sentEnd);
+    commandCallbacks.erase(commandCallbacks.begin(), sentEnd);
+    for (auto const &response : responses){
+        auto it = callbacks.find(response.command_id);
+        if (it == callbacks.end())
+            continue;
+        it->second->commandCompleted(response.command_id, response.user_defined);
+        callbacks.erase(it);
+    }
+    for (auto const &item : callbacks)
+        item.second->commandFailed(item.first);
+}
+
+/* ***********************************
+ * Cached generic messages
+ * ********************************** */
+void CarlanetManager::checkCacheScope(CarlaResponseCache::Scope scope, simtime_t ttl) const{
+    if (scope == CarlaResponseCache::TTL && ttl <= 0)
+        throw cRuntimeError("Cached CARLA request with scope TTL: the ttl must be positive (got %g)", ttl.dbl());
+}
+
+json CarlanetManager::sendToAndGetFromCarla(json requestMessage, CarlaResponseCache::Scope scope, simtime_t ttl){
+    checkCacheScope(scope, ttl);
+    if (!responseCacheEnabled || scope == CarlaResponseCache::NONE)
+        return sendToAndGetFromCarla(requestMessage);
+    std::string key = getCacheKey(requestMessage);
+    if (auto cached = responseCache.find(key, simTime(), frameIndex))
+        return *cached;
+    json response = sendToAndGetFromCarla(requestMessage);
+    responseCache.insert(key, response, scope, simTime(), frameIndex, ttl);
+    return response;
+}
+
+
+/* ***********************************
+ * Asynchronous generic messages
+ * ********************************** */
+int CarlanetManager::sendToCarlaAsync(const json& requestMessage, ICommandCallback* callback){
+    Enter_Method("sendToCarlaAsync");
+    carla_api_base::command request;
+    request.command_id = nextCommandId++;
+    request.user_defined = requestMessage;
+    pendingAsyncRequests.push_back(request);
+    if (callback != nullptr)
+        asyncCallbacks[request.command_id] = callback;
+    if (!asyncRequestsEvent->isScheduled())
+        scheduleAt(simTime(), asyncRequestsEvent);
+    return request.command_id;
+}
+
+void CarlanetManager::flushAsyncRequests(){
+    carla_api::generic_batch msg;
+    msg.timestamp = simTime().dbl();
+    msg.requests.swap(pendingAsyncRequests);
+    numAsyncRequests += msg.requests.size();
+    numAsyncBatches++;
+    json jsonMsg = msg;
+    sendToCarla(jsonMsg);
+    auto response = receiveFromCarla<carla_api::generic_batch_response>(10.0);
+
+    // The callbacks are invoked in the order of the requests, whatever the order of the responses
+    map<int,const json*> responses = map<int,const json*>();
+    for (auto const &item : response.responses)
+        responses[item.command_id] = &item.user_defined;
+    for (auto const &request : msg.requests){
+        auto callback = asyncCallbacks.find(request.command_id);
+        if (callback == asyncCallbacks.end())
+            continue;  // no callback, or cancelled by a previous one
+        ICommandCallback* target = callback->second;
+        asyncCallbacks.erase(callback);
+        auto it = responses.find(request.command_id);
+        if (it != responses.end())
+            target->commandCompleted(request.command_id, *it->second);
+        else
+            target->commandFailed(request.command_id);
+    }
+}
+
+void CarlanetManager::updateNodesPosition(std::list<carla_api_base::actor_position> actors, bool completeFrame){
     set<string> knownActors = set<string>();
     for(auto const& item: modulesToTrack)
         knownActors.insert(item.first);
+    for(auto const& item: actorRecords)
+        knownActors.insert(item.first);
+
+    if (completeFrame)
+        frameIndex++;
+    CarlaStepNotification notification;
+    if (bulkStepNotification && mayHaveListeners(carlaStepCompletedSignal)){
+        notification.frameIndex = frameIndex;
+        notification.completeFrame = completeFrame;
+        notification.changedModules.reserve(actors.size());
+        stepNotification = &notification;
+    }
+    if (batchPoseConversion){
+        poseConversion.convert(actors);
+        if (verifyPoseConversion){
+            double error = poseConversion.verify(actors);
+            if (error > CarlaPoseConversion::getTolerance())
+                throw cRuntimeError("Batch pose conversion (%s) differs from the INET one by %g", CarlaPoseConversion::getKernelName(), error);
+        }
+    }
 
     // Update the mobility of actors or create new ones in they do not exist
+    size_t index = 0;
     for(auto const &actor : actors){
-        if (knownActors.find(actor.actor_id) == knownActors.end()){  //NOT FOUND
-            createAndInitializeActor(actor);
+        size_t i = index++;
+        bool known = knownActors.erase(actor.actor_id) > 0;
+        auto& schedule = actorSchedules[actor.actor_id];
+        schedule.lastFrame = frameIndex;
+        if (actor.update_divisor > 0)
+            schedule.updateDivisor = actor.update_divisor;
+        else if (!known && updateDivisors->size() > 0)
+            // Only CARLA knows the type of the actors it spawns, the divisor it applies must come with them
+            throw cRuntimeError("Actor %s has no update_divisor, which is required with updateDivisors", actor.actor_id.c_str());
+        if (dynamicNetworkPromotion && actor.is_net_active && (!known || actorRecords.count(actor.actor_id))){
+            // Dynamically created net-active actor: the promotion logic decides whether it needs a module
+            updateActorRecord(actor);
+            continue;
         }
-        else{
-            knownActors.erase(actor.actor_id);  //OK Found I can update it
+        if (!known){  //NOT FOUND: it is created, already in its position, with the rest of the batch
+            pendingCreations.push_back(actor);
+            continue;
         }
 
-        Coord position = Coord(actor.position[0], actor.position[1], actor.position[2]);
-        Coord velocity = Coord(actor.velocity[0],actor.velocity[1],actor.velocity[2]);
-        Quaternion rotation = Quaternion(EulerAngles(rad(actor.rotation[0]),rad(actor.rotation[1]),rad(actor.rotation[2])));
-        modulesToTrack[actor.actor_id]->nextPosition(position, velocity, rotation);
+        auto mobility = modulesToTrack[actor.actor_id];
+        bool changed = batchPoseConversion ?
+                applyActorPosition(mobility, actor, poseConversion.getPosition(i), poseConversion.getVelocity(i), poseConversion.getOrientation(i)) :
+                applyActorPosition(mobility, actor);
+        if (changed && stepNotification != nullptr)
+            stepNotification->changedModules.push_back(mobility);
+    }
+
+    // What is left in knownActors has been omitted from the frame
+    if (completeFrame && !(actors.empty() && knownActors.empty())){
+        emit(frameActorsSignal, (long) actors.size());
+        emit(frameReductionSignal, (double) knownActors.size() / (actors.size() + knownActors.size()));
     }
 
     // remove actors which where known but CARLA has just destroyed
     for (auto const &actorId : knownActors){
-        destroyActor(actorId);
+        if (!completeFrame)
+            break;
+        auto& schedule = actorSchedules[actorId];
+        if (frameIndex - schedule.lastFrame < schedule.updateDivisor)
+            continue;  // Not its turn yet, its mobility holds the last pose
+        if (areaOfInterestFiltering && schedule.updateDivisor > 0 && !dynamicActors.count(actorId) && !actorRecords.count(actorId))
+            continue;  // Statically declared node outside the areas of interest: it holds the last pose too
+        actorSchedules.erase(actorId);
+        actorAttributes.removeActor(actorId);
+
+        auto it = actorRecords.find(actorId);
+        if (it != actorRecords.end()){
+            if (it->second.materialized)
+                closeMaterialization(it->second);
+            actorRecords.erase(it);
+        }
+        if (modulesToTrack.count(actorId))  // also the modules of the demoted actors
+            pendingDestructions.push_back(actorId);
     }
 
+    applyPendingActorChanges();
+
+    if (dynamicNetworkPromotion)
+        emitPromotionStatistics();
+
+    if (stepNotification != nullptr){
+        emit(carlaStepCompletedSignal, stepNotification);
+        stepNotification = nullptr;
+    }
+}
+
+
+bool CarlanetManager::applyActorPosition(CarlaInetMobility* mobility, const carla_api_base::actor_position& actor){
+    Coord position = Coord(actor.position[0], actor.position[1], actor.position[2]);
+    Coord velocity = Coord(actor.velocity[0],actor.velocity[1],actor.velocity[2]);
+    Quaternion rotation = Quaternion(EulerAngles(rad(actor.rotation[0]),rad(actor.rotation[1]),rad(actor.rotation[2])));
+    return applyActorPosition(mobility, actor, position, velocity, rotation);
+}
+
+bool CarlanetManager::applyActorPosition(CarlaInetMobility* mobility, const carla_api_base::actor_position& actor,
+                                         const Coord& position, const Coord& velocity, const Quaternion& rotation){
+    bool notified;
+    if (actor.has_acceleration || actor.has_angular_velocity){
+        // What the frame does not provide is still estimated by the mobility
+        Coord acceleration = Coord(actor.acceleration[0], actor.acceleration[1], actor.acceleration[2]);
+        // Rates of alpha, beta and gamma (as the rotation), i.e. about the z, y and x axes; they are not angles
+        Coord angularVelocity = Coord(actor.angular_velocity[2], actor.angular_velocity[1], actor.angular_velocity[0]);
+        notified = mobility->nextPosition(position, velocity, rotation, actor.has_acceleration ? &acceleration : nullptr,
+                                          actor.has_angular_velocity ? &angularVelocity : nullptr);
+    }
+    else{
+        notified = mobility->nextPosition(position, velocity, rotation);
+    }
+    if (vehicleObstaclesEnabled && actor.has_extent)
+        vehicleObstacles.setExtent(mobility->getPoseStoreHandle(), Coord(actor.extent[0], actor.extent[1], actor.extent[2]));
+    // A step ignored by the mobility (in its dead-band) must not be seen by the other readers either
+    bool taken = notified || !mobility->isSkippingInDeadBand();
+    if (taken)
+        storeActorPose(mobility, position, velocity, rotation);
+    return taken;
+}
+
+void CarlanetManager::seedActorPose(CarlaInetMobility* mobility){
+    storeActorPose(mobility, mobility->getCurrentPosition(), mobility->getCurrentVelocity(), mobility->getCurrentAngularPosition());
+}
+
+void CarlanetManager::storeActorPose(CarlaInetMobility* mobility, const Coord& position, const Coord& velocity, const Quaternion& rotation){
+    poseStore.setPose(mobility->getPoseStoreHandle(), position, velocity, rotation, simTime());
+    if (spatialIndexEnabled)
+        spatialIndex.update(mobility->getPoseStoreHandle(), position);
+    if (vehicleObstaclesEnabled)
+        vehicleObstacles.update(mobility->getPoseStoreHandle(), position, rotation);
+}
+
+
+/* ***********************************
+ * Promotion/demotion of network-active actors
+ * ********************************** */
+std::vector<CarlanetManager::InterestRegion> CarlanetManager::parseRegions(const cValueArray* regions){
+    std::vector<InterestRegion> result;
+    for (int i = 0; i < regions->size(); i++){
+        auto region = check_and_cast<cValueMap*>(regions->get(i).objectValue());
+        result.push_back({region->get("xMin").doubleValue(), region->get("yMin").doubleValue(),
+                          region->get("xMax").doubleValue(), region->get("yMax").doubleValue()});
+    }
+    return result;
+}
+
+bool CarlanetManager::isInInterestArea(const Coord& position, double margin) const{
+    for (auto const &region : interestRegions){
+        if (position.x >= region.xMin - margin && position.x <= region.xMax + margin &&
+                position.y >= region.yMin - margin && position.y <= region.yMax + margin)
+            return true;
+    }
+    double range = interestRange + margin;
+    for (auto anchor : interestAnchors){
+        if (anchor->getCurrentPosition().sqrdist(position) <= range * range)
+            return true;
+    }
+    return false;
+}
+
+void CarlanetManager::updateActorRecord(const carla_api_base::actor_position& actor){
+    auto& record = actorRecords[actor.actor_id];
+    record.lastState = actor;
+
+    Coord position = Coord(actor.position[0], actor.position[1], actor.position[2]);
+    if (!record.materialized){
+        if (isInInterestArea(position, 0))
+            promoteActor(record);
+    }
+    else if (!isInInterestArea(position, interestHysteresis)){
+        demoteActor(record);
+    }
+    else{
+        auto mobility = modulesToTrack[actor.actor_id];
+        if (applyActorPosition(mobility, actor) && stepNotification != nullptr)
+            stepNotification->changedModules.push_back(mobility);
+    }
+}
+
+void CarlanetManager::promoteActor(ActorRecord& record){
+    // The module is created at the first promotion only: later ones start it up again, so the node keeps
+    // its identity and its statistics (recorded once, at the end of the run) across demotions
+    EV_INFO << "Materialising actor " << record.lastState.actor_id << endl;
+    auto it = modulesToTrack.find(record.lastState.actor_id);
+    if (it == modulesToTrack.end()){
+        pendingCreations.push_back(record.lastState);
+    }
+    else{
+        auto mobility = it->second;
+        initiateLifecycleOperation(mobility->getParentModule(), new ModuleStartOperation());
+        // Attach it to the pose updates again, from the last state of the actor
+        if (vehicleObstaclesEnabled)
+            setVehicleExtent(mobility);
+        applyActorPosition(mobility, record.lastState);
+        seedActorPose(mobility);  // back in the indexes even if the mobility ignored the step
+        if (stepNotification != nullptr)
+            stepNotification->changedModules.push_back(mobility);
+    }
+    record.materialized = true;
+    record.materializedSince = simTime();
+    record.numPromotions++;
+    numMaterialized++;
+    numPromotions++;
+}
+
+void CarlanetManager::demoteActor(ActorRecord& record){
+    EV_INFO << "Dematerialising actor " << record.lastState.actor_id << endl;
+    // The node is shut down and detached from the pose updates (the record keeps them), but not deleted
+    auto mobility = modulesToTrack[record.lastState.actor_id];
+    initiateLifecycleOperation(mobility->getParentModule(), new ModuleStopOperation());
+    spatialIndex.remove(mobility->getPoseStoreHandle());
+    vehicleObstacles.remove(mobility->getPoseStoreHandle());
+    if (stepNotification != nullptr)
+        stepNotification->removedActors.push_back(record.lastState.actor_id);
+    closeMaterialization(record);
+}
+
+void CarlanetManager::closeMaterialization(ActorRecord& record){
+    record.materialized = false;
+    record.materializedTime += simTime() - record.materializedSince;
+    numMaterialized--;
+    numDemotions++;
+}
+
+void CarlanetManager::initiateLifecycleOperation(cModule* node, LifecycleOperation* operation){
+    LifecycleOperation::StringMap params;
+    operation->initialize(node, params);
+    lifecycleController.initiateOperation(operation);  // it deletes the operation when done
+}
+
+void CarlanetManager::emitPromotionStatistics(){
+    long numDataOnly = actorRecords.size() - numMaterialized;
+    if (numMaterialized != lastEmittedMaterialized || numDataOnly != lastEmittedDataOnly){
+        emit(materializedActorsSignal, (long) numMaterialized);
+        emit(dataOnlyActorsSignal, numDataOnly);
+        lastEmittedMaterialized = numMaterialized;
+        lastEmittedDataOnly = numDataOnly;
+    }
 }
 
 
@@ -171,19 +757,201 @@ void CarlanetManager::handleMessage(cMessage *msg)
             EV_INFO << "Simulation step: " << this->simulationTimeStep << endl;
             scheduleAt(simTime() + this->simulationTimeStep, msg);
         }
+        else if (msg == asyncRequestsEvent){
+            flushAsyncRequests();
+        }
     }
 }
 
+/* ***********************************
+ * Spatial queries
+ * ********************************** */
+const CarlaSpatialIndex& CarlanetManager::getSpatialIndex() const{
+    if (!spatialIndexEnabled)
+        throw cRuntimeError("Spatial queries require the spatial index (spatialIndexCellSize > 0)");
+    return spatialIndex;
+}
+
+std::vector<CarlaInetMobility*> CarlanetManager::toModules(const std::vector<CarlaSpatialIndex::Handle>& handles) const{
+    std::vector<CarlaInetMobility*> result;
+    result.reserve(handles.size());
+    auto modules = poseStore.getModules();
+    for (auto handle : handles)
+        result.push_back(modules[poseStore.getIndex(handle)]);
+    return result;
+}
+
+std::vector<CarlaInetMobility*> CarlanetManager::getActorsInRange(const Coord& center, double radius) const{
+    std::vector<CarlaSpatialIndex::Handle> handles;
+    getSpatialIndex().getInRange(center, radius, handles);
+    return toModules(handles);
+}
+
+std::vector<CarlaInetMobility*> CarlanetManager::getNearestActors(const Coord& center, size_t k, const CarlaInetMobility* excluded) const{
+    std::vector<CarlaSpatialIndex::Handle> handles;
+    getSpatialIndex().getNearest(center, k, handles, std::numeric_limits<double>::infinity(),
+                                 excluded != nullptr ? excluded->getPoseStoreHandle() : -1);
+    return toModules(handles);
+}
+
+std::vector<CarlaInetMobility*> CarlanetManager::getActorsInRegion(double xMin, double yMin, double xMax, double yMax) const{
+    std::vector<CarlaSpatialIndex::Handle> handles;
+    getSpatialIndex().getInRegion(xMin, yMin, xMax, yMax, handles);
+    return toModules(handles);
+}
+
+
+void CarlanetManager::setVehicleExtent(CarlaInetMobility* mobility){
+    auto& configuration = mobility->getSharedCarlaActorConfiguration()->getJson();
+    auto extent = configuration.find("extent");
+    if (extent != configuration.end())
+        vehicleObstacles.setExtent(mobility->getPoseStoreHandle(), Coord((*extent)[0], (*extent)[1], (*extent)[2]));
+}
+
+
+/* ***********************************
+ * Static map geometry
+ * ********************************** */
+std::string CarlanetManager::getCarlaWorld(){
+    std::string world = par("carlaWorld").stdstringValue();
+    if (world.empty()){
+        auto& extraInitParams = getExtraInitParams();
+        auto it = extraInitParams.find("carla_world");
+        if (it != extraInitParams.end())
+            world = it->second.stdstringValue();
+    }
+    return world;
+}
+
+void CarlanetManager::loadStaticGeometry(){
+    auto loadStart = chrono::steady_clock::now();
+    std::string world = getCarlaWorld();
+    std::string cacheDirectory = par("staticGeometryCacheDirectory").stdstringValue();
+    std::string cacheFile;
+    if (!cacheDirectory.empty()){
+        if (world.empty())
+            throw cRuntimeError("The static geometry cache requires the world name (see the carlaWorld parameter)");
+        cacheFile = cacheDirectory + "/" + world + ".geometry.cbor";
+    }
+
+    carla_api::static_geometry geometry;
+    std::ifstream cached(cacheFile, std::ios::binary);
+    if (!cacheFile.empty() && cached){
+        EV_INFO << "Loading the static geometry of " << world << " from " << cacheFile << endl;
+        std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(cached)), std::istreambuf_iterator<char>());
+        geometry = json::from_cbor(bytes).get<carla_api::static_geometry>();
+    }
+    else{
+        carla_api::static_geometry_request request;
+        request.timestamp = simTime().dbl();
+        request.world = world;
+        json jsonRequest = request;
+        sendToCarla(jsonRequest);
+        json jsonGeometry = receiveFromCarla(100.0);
+        geometry = jsonGeometry.get<carla_api::static_geometry>();
+        if (!cacheFile.empty()){
+            std::ofstream cache(cacheFile, std::ios::binary);
+            if (!cache)
+                throw cRuntimeError("Cannot write the static geometry cache %s", cacheFile.c_str());
+            auto bytes = json::to_cbor(jsonGeometry);
+            cache.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        }
+    }
+
+    for (auto const &item : geometry.objects){
+        CarlaStaticGeometry::Object object;
+        object.label = item.label;
+        object.material = item.material;
+        object.box.center = Coord(item.location[0], item.location[1], item.location[2]);
+        object.box.halfExtent = Coord(item.extent[0], item.extent[1], item.extent[2]);
+        object.box.setOrientation(Quaternion(EulerAngles(rad(item.rotation[0]), rad(item.rotation[1]), rad(item.rotation[2]))));
+        std::copy(item.rotation, item.rotation + 3, object.rotation);
+        staticGeometry.add(object);
+    }
+
+    std::string exportFile = par("staticGeometryExportFile").stdstringValue();
+    if (!exportFile.empty()){
+        std::ofstream stream(exportFile);
+        staticGeometry.exportXml(stream);
+    }
+    staticGeometryLoadTime = chrono::duration<double>(chrono::steady_clock::now() - loadStart).count();
+    EV_INFO << "Static geometry: " << staticGeometry.size() << " objects" << endl;
+}
+
+
+/* ***********************************
+ * Area-of-interest filtering
+ * ********************************** */
+json CarlanetManager::getAreasOfInterest(){
+    carla_api_base::areas_of_interest areas;
+    for (auto const &region : areasOfInterest)
+        areas.rectangles.push_back({region.xMin, region.yMin, region.xMax, region.yMax});
+
+    if (areaOfInterestRadius > 0){
+        for (auto const &item : modulesToTrack){
+            if (netPassiveActors.count(item.first))
+                continue;
+            carla_api_base::area_of_interest_circle circle;
+            circle.actor_id = item.first;
+            auto& position = item.second->getCurrentPosition();
+            circle.center[0] = position.x;
+            circle.center[1] = position.y;
+            circle.radius = areaOfInterestRadius;
+            areas.circles.push_back(circle);
+        }
+    }
+
+    areasOfInterestChanged = false;
+    lastAreasOfInterestDeclaration = simTime();
+    return areas;
+}
+
+
 /* ***********************************
  * Dynamic creation/destroying actors
  * ********************************** */
-void CarlanetManager::createAndInitializeActor(carla_api_base::actor_position newActor){
+void CarlanetManager::applyPendingActorChanges(){
+    // Destroyed actors go first, so that their names are free before the new modules are created
+    for (auto const &actorId : pendingDestructions)
+        destroyActor(actorId);
+    pendingDestructions.clear();
+
+    if (pendingCreations.empty())
+        return;
+
+    auto batchStart = chrono::steady_clock::now();
+    if (batchedActorCreation){
+        createActors(pendingCreations);
+    }
+    else{
+        for (auto const &actor : pendingCreations)
+            createAndInitializeActor(actor);
+    }
+    flushRegistrations();  // it also stores their poses
+    for (auto const &actor : pendingCreations){
+        auto mobility = modulesToTrack[actor.actor_id];
+        if (vehicleObstaclesEnabled && actor.has_extent){
+            vehicleObstacles.setExtent(mobility->getPoseStoreHandle(), Coord(actor.extent[0], actor.extent[1], actor.extent[2]));
+            vehicleObstacles.update(mobility->getPoseStoreHandle(), mobility->getCurrentPosition(), mobility->getCurrentAngularPosition());
+        }
+        if (stepNotification != nullptr)
+            stepNotification->changedModules.push_back(mobility);
+    }
+    emit(actorCreationBatchSizeSignal, (long) pendingCreations.size());
+    emit(actorCreationBatchTimeSignal, chrono::duration<double>(chrono::steady_clock::now() - batchStart).count());
+    pendingCreations.clear();
+}
+
+cModule* CarlanetManager::buildActorModule(const carla_api_base::actor_position& newActor){
     auto newActorModuleType = newActor.is_net_active ? networkActiveModuleType : networkPassiveModuleType;
     //auto newActorModuleName = newActor.is_net_active ? networkActiveModuleName : networkPassiveModuleName;
 
     cModule* root = getSimulation()->getSystemModule();
     cModuleType *actorType = cModuleType::get(newActorModuleType);
     cModule* new_mod = actorType->create(newActor.actor_id.c_str(), root);
+    dynamicActors.insert(newActor.actor_id);
+    if (!newActor.is_net_active)
+        netPassiveActors.insert(newActor.actor_id);
     new_mod->finalizeParameters();
     new_mod->buildInside();
     new_mod->scheduleStart(simTime());
@@ -196,14 +964,49 @@ void CarlanetManager::createAndInitializeActor(carla_api_base::actor_position ne
     auto CarlaInetMobilityMod = check_and_cast<CarlaInetMobility *>(new_mod->getSubmodule("mobility"));
     CarlaInetMobilityMod->preInitialize(position, velocity, rotation);
 
+    return new_mod;
+}
+
+void CarlanetManager::createAndInitializeActor(const carla_api_base::actor_position& newActor){
+    cModule* new_mod = buildActorModule(newActor);
+
     // The INET visualizer listens to model change notifications on the
     // network object by default. We assume this is our parent.
-    auto* notification = new inet::cPreModuleInitNotification();
-    notification->module = new_mod;
-    root->emit(POST_MODEL_CHANGE, notification, NULL);
+    inet::cPreModuleInitNotification notification;
+    notification.module = new_mod;
+    getSimulation()->getSystemModule()->emit(POST_MODEL_CHANGE, &notification, NULL);
 
     new_mod->callInitialize();
+}
+
+void CarlanetManager::createActors(const std::vector<carla_api_base::actor_position>& newActors){
+    // Build all the modules first...
+    std::vector<cModule*> newModules;
+    newModules.reserve(newActors.size());
+    for (auto const &actor : newActors)
+        newModules.push_back(buildActorModule(actor));
 
+    // ...notify the listeners (the INET visualizers only handle cPreModuleInitNotification)...
+    // The notification is per module by design: OMNeT++ has no batch model change and the listeners expect
+    // one for each module, so this cost is not batched. It is skipped when nobody listens (e.g. no visualizer).
+    cModule* root = getSimulation()->getSystemModule();
+    if (root->mayHaveListeners(POST_MODEL_CHANGE)){
+        for (auto mod : newModules){
+            inet::cPreModuleInitNotification notification;
+            notification.module = mod;
+            root->emit(POST_MODEL_CHANGE, &notification, NULL);
+        }
+    }
+
+    // ...and initialize them together, stage by stage, so that each stage sees all the new nodes
+    // (in the initialize context, as callInitialize() does)
+    cContextTypeSwitcher contextType(CTX_INITIALIZE);
+    bool moreStages = true;
+    for (int stage = 0; moreStages; stage++){
+        moreStages = false;
+        for (auto mod : newModules)
+            moreStages |= mod->callInitialize(stage);
+    }
 }
 
 
@@ -211,16 +1014,31 @@ void CarlanetManager::destroyActor(string actorId){
     //NOTE the map contains the reference to the mobilityModule
     // This implementation assumes that mobility module is a direct child of the actor module
     auto mod = modulesToTrack[actorId]->getParentModule();
+    actorConfigurations.release(modulesToTrack[actorId]->getCarlaActorConfiguration());
+    poseStore.remove(modulesToTrack[actorId]->getPoseStoreHandle());
+    spatialIndex.remove(modulesToTrack[actorId]->getPoseStoreHandle());
+    vehicleObstacles.remove(modulesToTrack[actorId]->getPoseStoreHandle());
 
     mod->callFinish();
     mod->deleteModule();
 
     modulesToTrack.erase(actorId);
+    dynamicActors.erase(actorId);
+    netPassiveActors.erase(actorId);
+    if (stepNotification != nullptr)
+        stepNotification->removedActors.push_back(actorId);
 
 }
 
 
 json CarlanetManager::receiveFromCarla(double timeoutFactor){
+    zmq::message_t reply = receiveRawFromCarla(timeoutFactor);
+    json jsonResp = json::parse(reply.to_string());
+    checkSimulationStatus(jsonResp["simulation_status"].get<int>());
+    return jsonResp;
+}
+
+zmq::message_t CarlanetManager::receiveRawFromCarla(double timeoutFactor){
     // set actual timeout
     int recv_timeout_ms =  max(4000, int(timeout_ms * timeoutFactor));
     this->socket.setsockopt(ZMQ_RCVTIMEO, recv_timeout_ms);
@@ -232,9 +1050,12 @@ json CarlanetManager::receiveFromCarla(double timeoutFactor){
         throw runtime_error("CALRA Timeout");
         //EV_ERROR << "receive error"<<endl;
     }
-    json jsonResp = json::parse(reply.to_string());
+    lastMessageSize = reply.size();
+    return reply;
+}
 
-    switch (jsonResp["simulation_status"].get<int>()){
+void CarlanetManager::checkSimulationStatus(int simulationStatus){
+    switch (simulationStatus){
     case SIM_STATUS_FINISHED_OK:
     case SIM_STATUS_FINISHED_ACCIDENT:
     case SIM_STATUS_FINISHED_TIME_LIMIT:
@@ -244,7 +1065,6 @@ json CarlanetManager::receiveFromCarla(double timeoutFactor){
         throw runtime_error("Communication error. Wrong message sequence!");
         break;
     }
-    return jsonResp;
 }
 
 
@@ -24,16 +24,75 @@
 #include "omnetpp.h"
 
 #include "carlaApi.h"
+#include "CarlaMessageChannel.h"
 #include "CarlaInetMobility.h"
+#include "CarlaActorConfiguration.h"
+#include "CarlaPoseStore.h"
+#include "CarlaPoseConversion.h"
+#include "CarlaSpatialIndex.h"
+#include "CarlaVehicleObstacles.h"
+#include "CarlaStaticGeometry.h"
+#include "CarlaActorAttributes.h"
+#include "CarlaResponseCache.h"
 #include "inet/common/INETDefs.h"
+#include "inet/common/lifecycle/LifecycleController.h"
+#include "inet/mobility/contract/IMobility.h"
 
 using namespace std;
 using namespace omnetpp;
 using namespace inet;
 
 
+/**
+ * Object emitted with the carlaStepCompleted signal, once for each frame received from CARLA,
+ * after all the actors of the frame have been updated, created or destroyed.
+ * It lets listeners (e.g. neighbour caches, visualizers) do a single update per step instead
+ * of one for each mobilityStateChanged signal. The poses are read from the mobility modules.
+ * The signal is emitted by CarlanetManager, so it can be subscribed to on the network module.
+ */
+class CarlaStepNotification : public cObject, public noncopyable
+{
+public:
+    long frameIndex = 0;
+    bool completeFrame = true;  // false for partial frames (INIT chunks)
+    std::vector<CarlaInetMobility*> changedModules;  // whose pose changed (even if the dead-band suppressed its notification) or created in the frame
+    std::vector<std::string> removedActors;  // ids of the actors whose module has been deleted or shut down (demoted) in the frame
+};
+
 
 class CarlanetManager: public cSimpleModule {
+public:
+    /**
+     * Callback interface for the outcome of the spawn requests.
+     * The callbacks are invoked in the context of CarlanetManager, so implementations that
+     * schedule or send messages must use Enter_Method.
+     */
+    class ISpawnCallback {
+    public:
+        virtual ~ISpawnCallback() {}
+
+        // The actor has been spawned and its module (nullptr if it has none, e.g. data-only actors) created
+        virtual void actorSpawned(int requestId, const std::string& actorId, cModule* module) = 0;
+
+        // CARLA could not spawn the actor
+        virtual void actorSpawnFailed(int requestId) {}
+    };
+
+    /**
+     * Callback interface for the responses to the deferred commands (see enqueueCommand()) and
+     * to the asynchronous generic messages (see sendToCarlaAsync()), invoked in the context of
+     * CarlanetManager as ISpawnCallback.
+     */
+    class ICommandCallback {
+    public:
+        virtual ~ICommandCallback() {}
+
+        virtual void commandCompleted(int commandId, const json& response) = 0;
+
+        // CARLA did not answer the command
+        virtual void commandFailed(int commandId) {}
+    };
+
 public:
     CarlanetManager();
     ~CarlanetManager();
@@ -45,8 +104,99 @@ public:
 
     simtime_t getCarlaInitialCarlaTimestamp() { return initial_timestamp; }
 
+    // False if only the per-module signals are emitted (stepNotification "perModule"); valid before initialize()
+    bool isStepCompletedSignalEmitted() const { return par("stepNotification").stdstringValue() != "perModule"; }
+
+
+    // Registrations are collected and inserted into the tracked modules in one go, when they are needed
+    void registerMobilityModule(CarlaInetMobility *mod) { pendingRegistrations.push_back(mod); }
+
+    // Stores the current pose of a registered mobility (e.g. its initial one) until CARLA sends the actor
+    void seedActorPose(CarlaInetMobility *mod);
+
+    // Returns the shared immutable copy of an actor configuration (see CarlaActorConfigurationPool)
+    const CarlaActorConfiguration* internActorConfiguration(const cValueMap* configuration) { return actorConfigurations.intern(configuration); }
+
+    /**
+     * Declares again the areas of interest to CARLA with the next simulation step message.
+     * Circular areas follow the net-active nodes, so this must be called when they have moved enough
+     * (unless areaOfInterestRefreshInterval is set).
+     */
+    void refreshAreasOfInterest() { areasOfInterestChanged = true; }
+
+    /**
+     * Asks CARLA to spawn a new actor. Requests are queued and sent in one batch with the next
+     * simulation step; the module of the actor is created in the frame returned by that step.
+     * Returns the id of the request, which is passed to the callback.
+     */
+    int requestSpawn(const std::string& actorType, const json& actorConfiguration, bool isNetActive, ISpawnCallback* callback = nullptr);
+
+    /**
+     * Asks CARLA to destroy an actor with the next simulation step; its module is deleted
+     * in the frame returned by that step.
+     */
+    void requestDespawn(const std::string& actorId);
+
+    // Drops the callback from the spawn requests in flight, e.g. when its module is deleted
+    void cancelSpawnRequests(ISpawnCallback* callback);
+
+    /**
+     * Deferred alternative to sendToAndGetFromCarla(): the command is queued and sent with the next
+     * simulation step, and the response is passed to the callback when the frame of that step is received
+     * (after the actors have been updated). Commands of all the applications share the round trip of the step.
+     * Returns the id of the command, which is passed to the callback.
+     */
+    int enqueueCommand(const json& command, ICommandCallback* callback = nullptr);
+
+    // Variant for the types implementing "to_json", as the templated sendToAndGetFromCarla()
+    template<typename S> int enqueueCommand(const S& command, ICommandCallback* callback = nullptr){
+        json jsonCommand = command;
+        return enqueueCommand(jsonCommand, callback);
+    }
+
+    // Drops the callback from the commands and asynchronous messages in flight, e.g. when its module is deleted
+    void cancelCommands(ICommandCallback* callback);
 
-    void registerMobilityModule(CarlaInetMobility *mod);
+    /**
+     * Bulk read API: the current poses of all the actors with a mobility module, as contiguous arrays
+     * (see CarlaPoseStore), for whole-fleet computations such as distance matrices.
+     */
+    const CarlaPoseStore& getPoseStore() const { return poseStore; }
+
+    /**
+     * Returns the pose that the actor of the given mobility module had at the given time
+     * (nullptr if it is older than the pose history, see poseHistoryLength).
+     */
+    const CarlaPoseSample* getPoseAt(CarlaInetMobility* mobility, simtime_t time) const { return poseStore.getPoseAt(mobility->getPoseStoreHandle(), time); }
+
+    /**
+     * Spatial queries over the actors with a mobility module, answered by a uniform grid updated with
+     * each frame (see spatialIndexCellSize). The results are the mobility modules of the actors;
+     * getSpatialIndex() gives the pose store handles instead, without the conversion.
+     */
+    // Actors within radius from center
+    std::vector<CarlaInetMobility*> getActorsInRange(const Coord& center, double radius) const;
+    // The k actors nearest to center, from the nearest, excluding the given one (e.g. the asking actor)
+    std::vector<CarlaInetMobility*> getNearestActors(const Coord& center, size_t k, const CarlaInetMobility* excluded = nullptr) const;
+    // Actors inside the rectangle
+    std::vector<CarlaInetMobility*> getActorsInRegion(double xMin, double yMin, double xMax, double yMax) const;
+    const CarlaSpatialIndex& getSpatialIndex() const;
+
+    // Bodies of the vehicles, for the obstacle loss (nullptr if vehicleObstacles is disabled)
+    const CarlaVehicleObstacles* getVehicleObstacles() const { return vehicleObstaclesEnabled ? &vehicleObstacles : nullptr; }
+
+    // Static geometry of the map, for line-of-sight queries and the obstacle loss (nullptr if importStaticGeometry is disabled)
+    const CarlaStaticGeometry* getStaticGeometry() const { return importStaticGeometry ? &staticGeometry : nullptr; }
+
+    /**
+     * Asks CARLA to stream an attribute (e.g. "speed") of the actor, or of all the actors if actorId is empty,
+     * with each frame. Subscriptions made during the initialization are sent with INIT, later ones with the
+     * next simulation step. The values are then read locally (see getActorAttributes()), without requests.
+     */
+    CarlaActorAttributes::AttributeId subscribeActorAttribute(const std::string& attribute, const std::string& actorId = "");
+
+    // Last values of the subscribed attributes, updated before the actors of each frame
+    const CarlaActorAttributes& getActorAttributes() const { return actorAttributes; }
 
 
 protected:
@@ -67,7 +217,17 @@ private:
     void doSimulationTimeStep();
     void initializeCarla();
     void findModulesToTrack();
-    void updateNodesPosition(std::list<carla_api_base::actor_position> actor);
+    void flushRegistrations();
+    // Partial frames (e.g. INIT chunks) only update or create the actors they contain
+    void updateNodesPosition(std::list<carla_api_base::actor_position> actor, bool completeFrame = true);
+    // Returns true if the mobility takes the pose, also without notifying it (in its dead-band, with skipInDeadBand
+    // false); only then the pose store and the indexes are updated and the module is reported as changed
+    bool applyActorPosition(CarlaInetMobility* mobility, const carla_api_base::actor_position& actor);
+    bool applyActorPosition(CarlaInetMobility* mobility, const carla_api_base::actor_position& actor,
+                            const Coord& position, const Coord& velocity, const Quaternion& rotation);
+    bool batchPoseConversion;
+    bool verifyPoseConversion;
+    CarlaPoseConversion poseConversion;
 
     void sendToCarla(json jsonMsg){
         std::stringstream msg;
@@ -75,6 +235,8 @@ private:
     }
 
     json receiveFromCarla(double timeoutFactor);
+    zmq::message_t receiveRawFromCarla(double timeoutFactor);
+    void checkSimulationStatus(int simulationStatus);
 
     template <typename T> T receiveFromCarla(double timeoutFactor = 1){
         return receiveFromCarla(timeoutFactor).get<T>();
@@ -84,22 +246,158 @@ private:
     string protocol;
     string host;
     double simulationTimeStep;
+    int initChunkSize;
+    bool useConfigurationTemplates;
+    bool typedMessageChannels;
+    std::string wireBuffer;  // reused by the typed channels
     simtime_t initial_timestamp = 0;
     int port;
     zmq::context_t context;
     zmq::socket_t socket;
     int timeout_ms;
     cMessage *simulationTimeStepEvent =  new cMessage("simulationTimeStep");
-    map<string,CarlaInetMobility*> modulesToTrack = map<string,CarlaInetMobility*>();
+    bool perModuleStepNotification;
+    bool bulkStepNotification;
+    CarlaStepNotification* stepNotification = nullptr;  // collected only while the frame is processed and someone listens
+    map<string,CarlaInetMobility*> modulesToTrack = map<string,CarlaInetMobility*>();  // ordered, the INIT actors and the areas of interest follow it
+    std::vector<CarlaInetMobility*> pendingRegistrations;
+    CarlaPoseStore poseStore;
+    bool spatialIndexEnabled;
+    CarlaSpatialIndex spatialIndex;
+    bool vehicleObstaclesEnabled;
+    CarlaVehicleObstacles vehicleObstacles;
+    void setVehicleExtent(CarlaInetMobility* mobility);
+    void storeActorPose(CarlaInetMobility* mobility, const Coord& position, const Coord& velocity, const Quaternion& rotation);
+
+    //Static map geometry, imported once and cached on disk by world
+    void loadStaticGeometry();
+    std::string getCarlaWorld();
+    bool importStaticGeometry;
+    CarlaStaticGeometry staticGeometry;
+    double staticGeometryLoadTime = 0;
+    std::vector<CarlaInetMobility*> toModules(const std::vector<CarlaSpatialIndex::Handle>& handles) const;
+
+    //Attributes streamed with the frames
+    CarlaActorAttributes actorAttributes;
 
 
     //Handlers for dynamic actor creation/destroying
-    void createAndInitializeActor(carla_api_base::actor_position newActor);
+    // Creations and destructions are collected while a frame is processed and applied at its end
+    void applyPendingActorChanges();
+    cModule* buildActorModule(const carla_api_base::actor_position& newActor);
+    void createAndInitializeActor(const carla_api_base::actor_position& newActor);
+    void createActors(const std::vector<carla_api_base::actor_position>& newActors);
     void destroyActor(string actorId);
+    bool batchedActorCreation;
+    std::vector<carla_api_base::actor_position> pendingCreations;
+    std::vector<string> pendingDestructions;
+    double initializationWallTime = 0;
+    double initBuildWallTime = 0;
+    size_t numInitActors = 0;
+    CarlaActorConfigurationPool actorConfigurations;
+    double startupWallTime = 0;
+    chrono::steady_clock::time_point constructionTime = chrono::steady_clock::now();  // startupWallTime covers only the modules built after the manager
     const char* networkActiveModuleType;
     const char* networkPassiveModuleType;
 
 
+    //Promotion/demotion of network-active actors between data-only records and full network nodes
+    struct InterestRegion {
+        double xMin, yMin, xMax, yMax;
+    };
+
+    /**
+     * Lightweight record kept for every net-active actor handled by the promotion logic.
+     * The record and the module (created at the first promotion) survive demotions, which only shut
+     * the node down, so that the identity of the actor and its statistics are preserved across promotions.
+     */
+    struct ActorRecord {
+        carla_api_base::actor_position lastState;
+        bool materialized = false;
+        int numPromotions = 0;
+        simtime_t materializedSince;
+        simtime_t materializedTime;  // accumulated time spent as full network node
+    };
+
+    static std::vector<InterestRegion> parseRegions(const cValueArray* regions);
+    bool isInInterestArea(const Coord& position, double margin) const;
+    void updateActorRecord(const carla_api_base::actor_position& actor);
+    void promoteActor(ActorRecord& record);
+    void demoteActor(ActorRecord& record);
+    void closeMaterialization(ActorRecord& record);
+    void initiateLifecycleOperation(cModule* node, LifecycleOperation* operation);
+    void emitPromotionStatistics();
+
+    LifecycleController lifecycleController;
+
+    bool dynamicNetworkPromotion;
+    double interestRange;
+    double interestHysteresis;
+    std::vector<InterestRegion> interestRegions;
+    std::vector<IMobility*> interestAnchors;
+    map<string,ActorRecord> actorRecords = map<string,ActorRecord>();
+    int numMaterialized = 0;
+    int numPromotions = 0;
+    int numDemotions = 0;
+    long lastEmittedMaterialized = -1;
+    long lastEmittedDataOnly = -1;
+
+
+    //Area-of-interest filtering of the actors sent by CARLA
+    json getAreasOfInterest();
+    bool areaOfInterestFiltering;
+    std::vector<InterestRegion> areasOfInterest;
+    double areaOfInterestRadius;
+    simtime_t areaOfInterestRefreshInterval;
+    simtime_t lastAreasOfInterestDeclaration;
+    bool areasOfInterestChanged = false;
+    set<string> dynamicActors = set<string>();  // actors whose module has been created from a frame
+    set<string> netPassiveActors = set<string>();  // dynamically created actors which are not network nodes
+    size_t lastMessageSize = 0;
+
+
+    //Spawn and despawn requests from the OMNeT++ side
+    void notifySpawnOutcomes(const std::list<carla_api_base::spawned_actor>& spawnedActors);
+    std::vector<carla_api_base::spawn_request> pendingSpawnRequests;
+    std::vector<string> pendingDespawnRequests;
+    map<int,ISpawnCallback*> spawnCallbacks = map<int,ISpawnCallback*>();  // by request id, for the requests in flight
+    int nextSpawnRequestId = 0;
+
+
+    //Commands deferred to the next simulation step
+    void notifyCommandResponses(const std::list<carla_api_base::command_response>& responses);
+    std::vector<carla_api_base::command> pendingCommands;
+    map<int,ICommandCallback*> commandCallbacks = map<int,ICommandCallback*>();  // by command id, for the commands in flight
+    int nextCommandId = 0;
+    long numCommands = 0;
+    long numCommandSteps = 0;  // steps which carried commands
+
+
+    //Cached responses of the generic messages
+    bool responseCacheEnabled;
+    CarlaResponseCache responseCache;
+
+
+    //Asynchronous generic messages, coalesced by timestamp
+    void flushAsyncRequests();
+    cMessage *asyncRequestsEvent = new cMessage("asyncRequests");
+    std::vector<carla_api_base::command> pendingAsyncRequests;
+    map<int,ICommandCallback*> asyncCallbacks = map<int,ICommandCallback*>();
+    long numAsyncRequests = 0;
+    long numAsyncBatches = 0;
+
+
+    //Level-of-detail update rates
+    struct ActorSchedule {
+        int updateDivisor = 1;
+        long lastFrame = 0;  // last frame which contained the actor
+    };
+    int getUpdateDivisor(CarlaInetMobility* mobility);
+    cValueMap* updateDivisors;
+    map<string,ActorSchedule> actorSchedules = map<string,ActorSchedule>();
+    long frameIndex = 0;
+
+
 public:
     //API used by applications
     /**
@@ -124,11 +422,83 @@ public:
      * by the "nlohmann/json" library
      */
     template<typename S, typename T> T sendToAndGetFromCarla(S requestMessage){
+        // Types declared with CARLA_DEFINE_MESSAGE are sent without json trees
+        typedef std::integral_constant<bool, CarlaMessageTraits<S>::defined && CarlaMessageTraits<T>::defined> typed;
+        return sendToAndGetFromCarla<S, T>(requestMessage, typed());
+    }
+
+    /**
+     * Variants for idempotent queries, whose responses are served from a local cache keyed by the content
+     * of the request: for the whole run (CarlaResponseCache::RUN), until the next frame (STEP) or for ttl (TTL,
+     * which requires a positive ttl).
+     */
+    json sendToAndGetFromCarla(json requestMessage, CarlaResponseCache::Scope scope, simtime_t ttl = 0);
+
+    template<typename S, typename T> T sendToAndGetFromCarla(S requestMessage, CarlaResponseCache::Scope scope, simtime_t ttl = 0){
+        typedef std::integral_constant<bool, CarlaMessageTraits<S>::defined && CarlaMessageTraits<T>::defined> typed;
+        return sendToAndGetFromCarla<S, T>(requestMessage, scope, ttl, typed());
+    }
+
+    /**
+     * Asynchronous variant of sendToAndGetFromCarla(): it returns at once with the id of the request,
+     * and the response is passed to the callback. The requests issued at the same simulation time are
+     * sent together in a single GENERIC_BATCH exchange, after all the other events of that time
+     * (but the ones with a lower priority), and the callbacks are invoked in the order of the requests.
+     */
+    int sendToCarlaAsync(const json& requestMessage, ICommandCallback* callback = nullptr);
+
+private:
+    template<typename S, typename T> T sendToAndGetFromCarla(const S& requestMessage, std::false_type){
         json jsonRequestMessage = requestMessage;
         json jsonResponseMessage = sendToAndGetFromCarla(jsonRequestMessage);
         return jsonResponseMessage.get<T>();
     }
 
+    template<typename S, typename T> T sendToAndGetFromCarla(const S& requestMessage, std::true_type){
+        if (!typedMessageChannels)
+            return sendToAndGetFromCarla<S, T>(requestMessage, std::false_type());
+        carlaWriteGenericMessage(wireBuffer, simTime().dbl(), requestMessage);
+        socket.send(zmq::buffer(wireBuffer), zmq::send_flags::none);
+        zmq::message_t reply = receiveRawFromCarla(10.0);
+        T responseMessage;
+        checkSimulationStatus(carlaReadGenericResponse(static_cast<const char*>(reply.data()), reply.size(), responseMessage));
+        return responseMessage;
+    }
+
+    void checkCacheScope(CarlaResponseCache::Scope scope, simtime_t ttl) const;
+
+    // Key of a cached request, the same for the json and the typed overloads (objects are sorted by key,
+    // so equal requests give the same text)
+    static std::string getCacheKey(const json& requestMessage) { return requestMessage.dump(); }
+
+    template<typename S, typename T> T sendToAndGetFromCarla(const S& requestMessage, CarlaResponseCache::Scope scope, simtime_t ttl, std::false_type){
+        json jsonRequestMessage = requestMessage;
+        return sendToAndGetFromCarla(jsonRequestMessage, scope, ttl).template get<T>();
+    }
+
+    // Misses go through the typed channel, the responses are cached as json (converted back on hits).
+    // The key is the one of the json overload, so both share the cached responses
+    template<typename S, typename T> T sendToAndGetFromCarla(const S& requestMessage, CarlaResponseCache::Scope scope, simtime_t ttl, std::true_type){
+        if (!typedMessageChannels)
+            return sendToAndGetFromCarla<S, T>(requestMessage, scope, ttl, std::false_type());
+        checkCacheScope(scope, ttl);
+        if (!responseCacheEnabled || scope == CarlaResponseCache::NONE)
+            return sendToAndGetFromCarla<S, T>(requestMessage, std::true_type());
+        std::string key = getCacheKey(json(requestMessage));
+        if (auto cached = responseCache.find(key, simTime(), frameIndex))
+            return cached->template get<T>();
+        T responseMessage = sendToAndGetFromCarla<S, T>(requestMessage, std::true_type());
+        responseCache.insert(key, responseMessage, scope, simTime(), frameIndex, ttl);
+        return responseMessage;
+    }
+
+public:
+
+    template<typename S> int sendToCarlaAsync(const S& requestMessage, ICommandCallback* callback = nullptr){
+        json jsonRequestMessage = requestMessage;
+        return sendToCarlaAsync(jsonRequestMessage, callback);
+    }
+
 };
 
 #endif
@@ -5,6 +5,9 @@
  * Messages exchanged between carlanetpp and pycarlanet
  */
 
+#ifndef CARLAAPI_H_
+#define CARLAAPI_H_
+
 #include "../lib/json.hpp"
 
 using json = nlohmann::json;
@@ -22,9 +25,28 @@ namespace carla_api_base{
     struct init_actor {
         std::string actor_id;
         std::string actor_type;
-        json actor_configuration;
+        json actor_configuration;  // null if the configuration is given by actor_template
+        const json* shared_configuration = nullptr;  // if set, sent in place of actor_configuration (see CarlaActorConfiguration)
+        std::string actor_template;  // name of one of the INIT actor_templates, empty if actor_configuration is given
+        int update_divisor = 0;  // the actor is sent every update_divisor simulation steps
     };
-    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(init_actor, actor_id, actor_type, actor_configuration)
+
+    // Only one of actor_configuration and actor_template is serialized, so the conversion is written by hand
+    inline void to_json(json& j, const init_actor& a) {
+        j = json{{"actor_id", a.actor_id}, {"actor_type", a.actor_type}, {"update_divisor", a.update_divisor}};
+        if (a.actor_template.empty())
+            j["actor_configuration"] = a.shared_configuration != nullptr ? *a.shared_configuration : a.actor_configuration;
+        else
+            j["actor_template"] = a.actor_template;
+    }
+
+    inline void from_json(const json& j, init_actor& a) {
+        j.at("actor_id").get_to(a.actor_id);
+        j.at("actor_type").get_to(a.actor_type);
+        j.at("update_divisor").get_to(a.update_divisor);
+        a.actor_template = j.value("actor_template", "");
+        a.actor_configuration = a.actor_template.empty() ? j.at("actor_configuration") : json();
+    }
 
 
     struct actor_position {
@@ -33,17 +55,130 @@ namespace carla_api_base{
         double velocity[3];  // x,y,z
         double rotation[3];  // pitch,yaw,roll
         bool is_net_active;
+        int update_divisor = 0;  // update rate divisor applied by CARLA to the actor (0: not specified; required for new actors if the updateDivisors table is used)
+        bool has_acceleration = false;
+        double acceleration[3] = {0, 0, 0};  // optional: x,y,z
+        bool has_angular_velocity = false;
+        double angular_velocity[3] = {0, 0, 0};  // optional: rates of the same angles as rotation, in rad/s
+        bool has_extent = false;
+        double extent[3] = {0, 0, 0};  // optional: half size of the bounding box, x,y,z
     };
-    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(actor_position, actor_id, position, velocity, rotation, is_net_active)
+
+    // Optional fields are serialized only if set, so they are written by hand
+    inline void to_json(json& j, const actor_position& p) {
+        j = json{{"actor_id", p.actor_id}, {"position", p.position}, {"velocity", p.velocity},
+                 {"rotation", p.rotation}, {"is_net_active", p.is_net_active}};
+        if (p.update_divisor > 0)
+            j["update_divisor"] = p.update_divisor;
+        if (p.has_acceleration)
+            j["acceleration"] = p.acceleration;
+        if (p.has_angular_velocity)
+            j["angular_velocity"] = p.angular_velocity;
+        if (p.has_extent)
+            j["extent"] = p.extent;
+    }
+
+    inline void from_json(const json& j, actor_position& p) {
+        j.at("actor_id").get_to(p.actor_id);
+        j.at("position").get_to(p.position);
+        j.at("velocity").get_to(p.velocity);
+        j.at("rotation").get_to(p.rotation);
+        j.at("is_net_active").get_to(p.is_net_active);
+        p.update_divisor = j.value("update_divisor", 0);
+        p.has_acceleration = j.contains("acceleration");
+        if (p.has_acceleration)
+            j.at("acceleration").get_to(p.acceleration);
+        p.has_angular_velocity = j.contains("angular_velocity");
+        if (p.has_angular_velocity)
+            j.at("angular_velocity").get_to(p.angular_velocity);
+        p.has_extent = j.contains("extent");
+        if (p.has_extent)
+            j.at("extent").get_to(p.extent);
+    }
 
 
     struct carla_configuration {
         int seed;
         double carla_timestep;
         double sim_time_limit;
+        json update_divisors;  // update rate divisors by actor type, applied to the actors spawned by CARLA
+    };
+
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(carla_configuration, seed, carla_timestep, sim_time_limit, update_divisors)
+
+
+    struct area_of_interest_rectangle {
+        double x_min;
+        double y_min;
+        double x_max;
+        double y_max;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(area_of_interest_rectangle, x_min, y_min, x_max, y_max)
+
+    struct area_of_interest_circle {
+        std::string actor_id;  // actor the circle is attached to, empty for nodes which are not CARLA actors
+        double center[2];  // x,y at declaration time
+        double radius;
     };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(area_of_interest_circle, actor_id, center, radius)
+
+    /* CARLA only sends the actors inside (the union of) these areas */
+    struct areas_of_interest {
+        std::list<area_of_interest_rectangle> rectangles;
+        std::list<area_of_interest_circle> circles;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(areas_of_interest, rectangles, circles)
+
+
+    struct spawn_request {
+        int request_id;
+        std::string actor_type;
+        json actor_configuration;
+        bool is_net_active;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(spawn_request, request_id, actor_type, actor_configuration, is_net_active)
+
+    struct spawned_actor {
+        int request_id;
+        std::string actor_id;  // its position is in the same frame
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(spawned_actor, request_id, actor_id)
+
+    // Application command deferred to the next simulation step (same content as a generic message)
+    struct command {
+        int command_id;
+        json user_defined;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(command, command_id, user_defined)
+
+    struct command_response {
+        int command_id;
+        json user_defined;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(command_response, command_id, user_defined)
+
+    // Static object of the map, as the level bounding boxes of CARLA
+    struct static_object {
+        std::string label;  // semantic label, e.g. "Buildings"
+        double location[3];  // centre, x,y,z
+        double extent[3];  // half size, x,y,z
+        double rotation[3];  // same angles as the actors
+        std::string material = "concrete";  // INET material
+    };
+
+    // The material is optional, so the conversion is written by hand
+    inline void to_json(json& j, const static_object& o) {
+        j = json{{"label", o.label}, {"location", o.location}, {"extent", o.extent},
+                 {"rotation", o.rotation}, {"material", o.material}};
+    }
 
-    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(carla_configuration, seed, carla_timestep, sim_time_limit)
+    inline void from_json(const json& j, static_object& o) {
+        j.at("label").get_to(o.label);
+        j.at("location").get_to(o.location);
+        j.at("extent").get_to(o.extent);
+        j.at("rotation").get_to(o.rotation);
+        o.material = j.value("material", "concrete");
+    }
 
 
 }
@@ -57,13 +192,60 @@ namespace carla_api{
         double timestamp;
         std::string run_id;
 
-        std::list<carla_api_base::init_actor> moving_actors;
+        std::vector<carla_api_base::init_actor> moving_actors;
         carla_api_base::carla_configuration carla_configuration;
 
         json user_defined;
 
+        json areas_of_interest;  // null: no filtering, every actor is sent
+
+        json actor_templates;  // actor configurations referenced by name from moving_actors, each sent once
+        bool has_more_chunks = false;  // the remaining moving_actors follow in INIT_CHUNK messages
+
+        json attribute_subscriptions;  // attribute name -> actor ids (null: all the actors); null: no attributes
+    };
+
+    // actor_templates and has_more_chunks are serialized only if used, so the conversion is written by hand
+    inline void to_json(json& j, const init& m) {
+        j = json{{"message_type", m.message_type}, {"timestamp", m.timestamp}, {"run_id", m.run_id},
+                 {"moving_actors", m.moving_actors}, {"carla_configuration", m.carla_configuration},
+                 {"user_defined", m.user_defined}, {"areas_of_interest", m.areas_of_interest},
+                 {"attribute_subscriptions", m.attribute_subscriptions}};
+        if (!m.actor_templates.is_null())
+            j["actor_templates"] = m.actor_templates;
+        if (m.has_more_chunks)
+            j["has_more_chunks"] = true;
+    }
+
+    inline void from_json(const json& j, init& m) {
+        j.at("message_type").get_to(m.message_type);
+        j.at("timestamp").get_to(m.timestamp);
+        j.at("run_id").get_to(m.run_id);
+        j.at("moving_actors").get_to(m.moving_actors);
+        j.at("carla_configuration").get_to(m.carla_configuration);
+        j.at("user_defined").get_to(m.user_defined);
+        j.at("areas_of_interest").get_to(m.areas_of_interest);
+        j.at("attribute_subscriptions").get_to(m.attribute_subscriptions);
+        m.actor_templates = j.value("actor_templates", json());
+        m.has_more_chunks = j.value("has_more_chunks", false);
+    }
+
+    /* OMNET --> CARLA */
+    struct init_chunk {
+        std::string message_type = "INIT_CHUNK";
+        double timestamp;
+        std::vector<carla_api_base::init_actor> moving_actors;
+        bool has_more_chunks;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(init_chunk, message_type, timestamp, moving_actors, has_more_chunks)
+
+    /* CARLA --> OMNET: reply to an INIT or INIT_CHUNK with has_more_chunks set */
+    struct init_chunk_completed {
+        std::string message_type = "INIT_CHUNK_COMPLETED";
+        std::list<carla_api_base::actor_position> actor_positions;  // actors spawned since the previous reply
+        int simulation_status;
     };
-    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(init, message_type, timestamp, run_id, moving_actors,carla_configuration, user_defined)
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(init_chunk_completed, message_type, actor_positions, simulation_status)
 
     /* CARLA --> OMNET */
     struct init_completed {
@@ -72,8 +254,24 @@ namespace carla_api{
         std::list<carla_api_base::actor_position> actor_positions;
         //carla_api_payload::init_completed payload;
         int simulation_status;
+        json actor_attributes;  // optional: subscribed attributes, as columns (see CarlaActorAttributes)
     };
-    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(init_completed, message_type, initial_timestamp, actor_positions, simulation_status)
+
+    // Only actor_attributes is optional, so the conversion is written by hand
+    inline void to_json(json& j, const init_completed& m) {
+        j = json{{"message_type", m.message_type}, {"initial_timestamp", m.initial_timestamp},
+                 {"actor_positions", m.actor_positions}, {"simulation_status", m.simulation_status}};
+        if (!m.actor_attributes.is_null())
+            j["actor_attributes"] = m.actor_attributes;
+    }
+
+    inline void from_json(const json& j, init_completed& m) {
+        j.at("message_type").get_to(m.message_type);
+        j.at("initial_timestamp").get_to(m.initial_timestamp);
+        j.at("actor_positions").get_to(m.actor_positions);
+        j.at("simulation_status").get_to(m.simulation_status);
+        m.actor_attributes = j.value("actor_attributes", json());
+    }
 
 
     /* OMNET --> CARLA*/
@@ -81,8 +279,13 @@ namespace carla_api{
         std::string message_type = "SIMULATION_STEP";
         double carla_timestep;
         double timestamp;
+        json areas_of_interest;  // null: the areas declared previously are still valid
+        std::vector<carla_api_base::spawn_request> spawn_requests;  // actors to spawn before the step
+        std::vector<std::string> despawn_requests;  // actors to destroy before the step
+        std::vector<carla_api_base::command> commands;  // applied before the step
+        json attribute_subscriptions;  // null: the subscriptions declared previously are still valid
     };
-    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(simulation_step, message_type, carla_timestep, timestamp)
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(simulation_step, message_type, carla_timestep, timestamp, areas_of_interest, spawn_requests, despawn_requests, commands, attribute_subscriptions)
 
 
     /* CARLA --> OMNET */
@@ -90,8 +293,50 @@ namespace carla_api{
         std::string message_type = "UPDATED_POSITIONS";
         std::list<carla_api_base::actor_position> actor_positions;
         int simulation_status;
+        int num_outside_actors = 0;  // summary of the actors omitted because outside the areas of interest
+        std::list<carla_api_base::spawned_actor> spawned_actors;  // outcome of the spawn requests (missing ones failed)
+        std::list<std::string> despawned_actors;  // actors destroyed by a despawn request
+        std::list<carla_api_base::command_response> command_responses;  // responses to the commands of the step (missing ones failed)
+        json actor_attributes;  // optional: subscribed attributes, as columns (see CarlaActorAttributes)
     };
-    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(updated_postion, message_type, actor_positions, simulation_status)
+
+    // The fields added after actor_positions and simulation_status are optional, so the conversion is written by hand
+    inline void to_json(json& j, const updated_postion& m) {
+        j = json{{"message_type", m.message_type}, {"actor_positions", m.actor_positions}, {"simulation_status", m.simulation_status},
+                 {"num_outside_actors", m.num_outside_actors}, {"spawned_actors", m.spawned_actors},
+                 {"despawned_actors", m.despawned_actors}, {"command_responses", m.command_responses}};
+        if (!m.actor_attributes.is_null())
+            j["actor_attributes"] = m.actor_attributes;
+    }
+
+    inline void from_json(const json& j, updated_postion& m) {
+        j.at("message_type").get_to(m.message_type);
+        j.at("actor_positions").get_to(m.actor_positions);
+        j.at("simulation_status").get_to(m.simulation_status);
+        m.num_outside_actors = j.value("num_outside_actors", 0);
+        m.spawned_actors = j.value("spawned_actors", std::list<carla_api_base::spawned_actor>());
+        m.despawned_actors = j.value("despawned_actors", std::list<std::string>());
+        m.command_responses = j.value("command_responses", std::list<carla_api_base::command_response>());
+        m.actor_attributes = j.value("actor_attributes", json());
+    }
+
+
+    /* OMNET --> CARLA: sent after INIT_COMPLETED, only if the geometry is not cached */
+    struct static_geometry_request {
+        std::string message_type = "STATIC_GEOMETRY_REQUEST";
+        double timestamp;
+        std::string world;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(static_geometry_request, message_type, timestamp, world)
+
+    /* CARLA --> OMNET */
+    struct static_geometry {
+        std::string message_type = "STATIC_GEOMETRY";
+        std::string world;
+        std::list<carla_api_base::static_object> objects;
+        int simulation_status;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(static_geometry, message_type, world, objects, simulation_status)
 
 
     struct generic_message {
@@ -109,4 +354,23 @@ namespace carla_api{
     };
     NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(generic_response, message_type, user_defined ,simulation_status)
 
+
+    /* OMNET --> CARLA: asynchronous generic messages issued at the same timestamp */
+    struct generic_batch {
+        std::string message_type = "GENERIC_BATCH";
+        double timestamp;
+        std::vector<carla_api_base::command> requests;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(generic_batch, message_type, timestamp, requests)
+
+    /* CARLA --> OMNET */
+    struct generic_batch_response {
+        std::string message_type = "GENERIC_BATCH_RESPONSE";
+        std::list<carla_api_base::command_response> responses;  // missing ones failed
+        int simulation_status;
+    };
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(generic_batch_response, message_type, responses, simulation_status)
+
 }
+
+#endif
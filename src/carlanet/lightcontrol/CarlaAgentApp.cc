@@ -30,6 +30,9 @@ Define_Module(CarlaAgentApp);
 CarlaAgentApp::~CarlaAgentApp()
 {
     //cancelAndDelete(updateStatusSelfMessage);
+    // The manager may be deleted first when the network is torn down
+    if (numPendingCommands > 0 && getSimulation()->getModule(carlanetManagerId) != nullptr)
+        carlanetManager->cancelCommands(this);
 }
 
 void CarlaAgentApp::initialize(int stage)
@@ -37,6 +40,8 @@ void CarlaAgentApp::initialize(int stage)
     ApplicationBase::initialize(stage);
     if (stage == INITSTAGE_LOCAL) {
         carlanetManager = check_and_cast<CarlanetManager*>(getParentModule()->getParentModule()->getSubmodule("carlanetManager"));
+        carlanetManagerId = carlanetManager->getId();
+        deferredCommands = par("deferredCommands");
         firstCommandMsg = new cMessage("firstCommandMsg");
         commandStartTime = par("sendInterval");
         /*actorId = getParentModule()->getName();
@@ -158,7 +163,17 @@ void CarlaAgentApp::sendNewLightCommand(){
     light_update lightStateMsg;
     lightStateMsg.light_curr_state = current_light_state;
 
+    if (deferredCommands){
+        // The command is sent when CARLA answers, with the next simulation step
+        carlanetManager->enqueueCommand(lightStateMsg, this);
+        numPendingCommands++;
+        return;
+    }
     auto lightCommandMsg = carlanetManager->sendToAndGetFromCarla<light_update, light_command>(lightStateMsg);
+    sendLightCommand(lightCommandMsg);
+}
+
+void CarlaAgentApp::sendLightCommand(const light_command& lightCommandMsg){
     const int fragmentLength = std::min((int) par("commandMsgLength"), (int) UDP_MAX_MESSAGE_SIZE-10);
     auto packet = new Packet("LightCommand_");
     auto data = makeShared<LightCommandMessage>();
@@ -170,3 +185,16 @@ void CarlaAgentApp::sendNewLightCommand(){
     socket.sendTo(packet, destAddress, destPort);
 }
 
+void CarlaAgentApp::commandCompleted(int commandId, const json& response){
+    Enter_Method("commandCompleted");
+    numPendingCommands--;
+    if (isUp())
+        sendLightCommand(response.get<light_command>());
+}
+
+void CarlaAgentApp::commandFailed(int commandId){
+    Enter_Method("commandFailed");
+    EV_WARN << "CARLA did not answer the light update " << commandId << endl;
+    numPendingCommands--;
+}
+
@@ -24,11 +24,14 @@ using namespace inet;
  * UDP application. See NED for more info.
  */
 
-class CarlaAgentApp : public ApplicationBase, public UdpSocket::ICallback
+class CarlaAgentApp : public ApplicationBase, public UdpSocket::ICallback, public CarlanetManager::ICommandCallback
 {
 
 private:
     CarlanetManager* carlanetManager;
+    int carlanetManagerId;
+    bool deferredCommands;
+    int numPendingCommands = 0;
     //cMessage* updateStatusSelfMessage;
     double commandStartTime;
         //const char *actorId;
@@ -81,6 +84,11 @@ protected:
     virtual void sendPacket(Packet *pk);
     virtual void processPacket(Packet *pk);
     void sendNewLightCommand();
+    void sendLightCommand(const light_command& lightCommandMsg);
+
+    /*Deferred commands*/
+    virtual void commandCompleted(int commandId, const json& response) override;
+    virtual void commandFailed(int commandId) override;
 
 public:
     ~CarlaAgentApp();
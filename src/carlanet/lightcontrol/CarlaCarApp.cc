@@ -32,6 +32,9 @@ Define_Module(CarlaCarApp);
 CarlaCarApp::~CarlaCarApp()
 {
     //cancelAndDelete(updateStatusSelfMessage);
+    // The manager may be deleted first when the network is torn down
+    if (!pendingReplies.empty() && getSimulation()->getModule(carlanetManagerId) != nullptr)
+        carlanetManager->cancelCommands(this);
 }
 
 void CarlaCarApp::initialize(int stage)
@@ -39,6 +42,8 @@ void CarlaCarApp::initialize(int stage)
     ApplicationBase::initialize(stage);
     if (stage == INITSTAGE_LOCAL) {
         carlanetManager = check_and_cast<CarlanetManager*>(getParentModule()->getParentModule()->getSubmodule("carlanetManager"));
+        carlanetManagerId = carlanetManager->getId();
+        deferredCommands = par("deferredCommands");
 
         //carlanetManager = check_and_cast<CarlanetManager*>(getParentModule()->getParentModule()->getSubmodule("carlanetManager"));
         //newCommandMsg = new cMessage("NewCommand");
@@ -141,20 +146,46 @@ void CarlaCarApp::processPacket(Packet *pk){
         light_command lightCommandMsg;
         lightCommandMsg.light_next_state = message_sp->getLightNextState();
 
+        if (deferredCommands){
+            // The status is sent back when CARLA answers, with the next simulation step
+            int commandId = carlanetManager->enqueueCommand(lightCommandMsg, this);
+            pendingReplies[commandId] = std::make_pair(destAddress, destPort);
+            return;
+        }
         light_update lightUpdateMsg = carlanetManager->sendToAndGetFromCarla<light_command, light_update>(lightCommandMsg);
-
-        auto packet = new Packet("LightStatus_");
-        auto data = makeShared<LightStatusMessage>();
-        const int fragmentLength = std::min((int) par("statusMsgLength"), (int) UDP_MAX_MESSAGE_SIZE-10);
-        data->setChunkLength(B(fragmentLength));
-        data->setLightCurrState(lightUpdateMsg.light_curr_state.c_str());
-        auto creationTimeTag = data->addTag<CreationTimeTag>(); // add new tag
-        creationTimeTag->setCreationTime(simTime()); // store current time
-        packet->insertAtBack(data);
-        socket.sendTo(packet, destAddress, destPort);
+        sendLightStatus(lightUpdateMsg, destAddress, destPort);
     }
     else{
         EV_WARN << "Received an unexpected packet "<< UdpSocket::getReceivedPacketInfo(pk) <<endl;
     }
 }
 
+void CarlaCarApp::sendLightStatus(const light_update& lightUpdateMsg, const L3Address& destAddress, int destPort){
+    auto packet = new Packet("LightStatus_");
+    auto data = makeShared<LightStatusMessage>();
+    const int fragmentLength = std::min((int) par("statusMsgLength"), (int) UDP_MAX_MESSAGE_SIZE-10);
+    data->setChunkLength(B(fragmentLength));
+    data->setLightCurrState(lightUpdateMsg.light_curr_state.c_str());
+    auto creationTimeTag = data->addTag<CreationTimeTag>(); // add new tag
+    creationTimeTag->setCreationTime(simTime()); // store current time
+    packet->insertAtBack(data);
+    socket.sendTo(packet, destAddress, destPort);
+}
+
+void CarlaCarApp::commandCompleted(int commandId, const json& response){
+    Enter_Method("commandCompleted");
+    auto it = pendingReplies.find(commandId);
+    if (it == pendingReplies.end())
+        return;
+    auto reply = it->second;
+    pendingReplies.erase(it);
+    if (isUp())
+        sendLightStatus(response.get<light_update>(), reply.first, reply.second);
+}
+
+void CarlaCarApp::commandFailed(int commandId){
+    Enter_Method("commandFailed");
+    EV_WARN << "CARLA did not answer the light command " << commandId << endl;
+    pendingReplies.erase(commandId);
+}
+
@@ -6,6 +6,7 @@
 #ifndef __CarlaCarApp_H
 #define __CarlaCarApp_H
 
+#include <map>
 #include <vector>
 #include <omnetpp.h>
 
@@ -22,11 +23,15 @@ using namespace inet;
 /**
  * UDP application. See NED for more info.
  */
-class CarlaCarApp : public ApplicationBase, public UdpSocket::ICallback
+class CarlaCarApp : public ApplicationBase, public UdpSocket::ICallback, public CarlanetManager::ICommandCallback
 {
 
 private:
     CarlanetManager* carlanetManager;
+    int carlanetManagerId;
+    bool deferredCommands;
+    // Senders waiting for the response of a deferred command, by command id
+    std::map<int,std::pair<L3Address,int>> pendingReplies;
     //cMessage* updateStatusSelfMessage;
 
 
@@ -73,6 +78,11 @@ protected:
 
     virtual void sendPacket(Packet *pk);
     virtual void processPacket(Packet *pk);
+    void sendLightStatus(const light_update& lightUpdateMsg, const L3Address& destAddress, int destPort);
+
+    /*Deferred commands*/
+    virtual void commandCompleted(int commandId, const json& response) override;
+    virtual void commandFailed(int commandId) override;
 
 public:
     ~CarlaCarApp();
@@ -32,11 +32,20 @@ std::vector<T*> getSubmodulesOfType(cModule* parentModule, bool recurse = false)
 }
 
 /**
- * Return the first module found of a specific type
+ * Return the first module found of a specific type (nullptr if there is none).
+ * The search stops at the first match and does not build the full list of submodules.
  */
 template <class T>
 T* getFirstSubmoduleOfType(cModule* parentModule, bool recurse = false){
-    return getSubmodulesOfType<T>(parentModule, recurse).front();
+    for (cModule::SubmoduleIterator iter(parentModule); !iter.end(); iter++) {
+        auto mm = dynamic_cast<T*>(*iter);
+        if (mm != nullptr) return mm;
+        if (recurse) {
+            auto m = getFirstSubmoduleOfType<T>(*iter, recurse);
+            if (m != nullptr) return m;
+        }
+    }
+    return nullptr;
 }
 
 